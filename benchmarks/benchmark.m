@@ -17,6 +17,15 @@ benchmark()
  w ! do benchmarkNodeCreation()
  w ! do benchmarkTraverse()
  w ! do benchmarkSignals()
+ w ! do benchmarkTypedCalls()
+ w ! do benchmarkMap()
+ w ! do benchmarkUpdates()
+ w ! do benchmarkCoroutines()
+ w ! do benchmarkBudget()
+ w ! do benchmarkStates()
+ w ! do benchmarkLibs()
+ w ! do benchmarkBytecodeCache()
+ w ! do benchmarkWorkers()
  w ! do benchmarkStringProcesses()
  quit
 
@@ -24,7 +33,9 @@ init(usertime)
  set hideProcess=$ztrnlnm("HIDE_PROCESS_TIME")'=""
  ; Create random 1MB string from Lua so we can have a reproducable one (fixed seed)
  ; Lua is faster, anyway (see notes in randomMB.lua)
- do lua(" ydb=require'yottadb' rand=require'randomMB' ")
+ do lua(" ydb=require'yottadb' rand=require'randomMB' mlua=require'mlua' ")
+ do lua(" function countChildren(glvn) local cnt=0 for sub in mlua.children(glvn) do cnt=cnt+1 end return cnt end ")
+ do lua(" function countNodes(glvn) local cnt=0 for value in mlua.nodes(glvn) do cnt=cnt+1 end return cnt end ")
  do lua(" function isfile(name) local f=io.open(name) return f ~= nil and io.close(f)  end ")
  ; the following time functions are unused since mlua introduced &mlua.nanoseconds(), but kept for posterity
  ;do lua(" cputime=require'cputime' ")
@@ -91,6 +102,11 @@ linearTraverse(subs,records)
  set code="set cnt=$$lua(""local cnt,n = 0,ydb.node("_$$subs2lua(subs)_") for k,v in pairs(n) do cnt=cnt+1 end return cnt"")"
  do minIterate(10,code)  ;don't do so many iterations because this one is slow
  w "Lua ",subs," traversal of ",cnt," node objs  in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+
+ ; batched iterator of module mlua in Lua
+ do minIterate(10,"do &mlua.lua("">countChildren"",.cnt,0,subs)")
+ do assert(cnt,records,"Not all records iterated")
+ w "Lua ",subs," mlua.children() of ",cnt," subs in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
  quit
 
 treeTraverse(subs,length,depth)
@@ -108,6 +124,15 @@ treeTraverse(subs,length,depth)
  do lua(" function counter(node, sub, val)  cnt=cnt+(val and 1 or 0)  end ")
  do minIterate(10,"set cnt=$$lua(""cnt=0 node:gettree(nil,counter) return cnt"")")
  w "Lua ",subs," traversal of ",cnt," records in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+
+ ; batched iterator of module mlua in Lua
+ do minIterate(10,"do &mlua.lua("">countNodes"",.cnt,0,subs)")
+ w "Lua ",subs," mlua.nodes() of ",cnt," records in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+
+ ; marshalled into a Lua table in C by mlua.tree() and traversed in Lua
+ do lua(" function countTree(t) local n=0 for k,v in pairs(t) do if k~=true then n=n+1 if type(v)=='table' then n=n+countTree(v) end end end return n end ")
+ do minIterate(10,"do assert($&mlua.tree("">countTree"",.cnt,0,subs),0)")
+ w "Lua ",subs," mlua.tree() of ",cnt," records in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
  quit
 
 subs2lua(subs)
@@ -152,6 +177,8 @@ benchmarkSignals()
  w "MLua calling overhead without signal blocking: ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
  set processtime=$$iterateCall(iterations,$&mlua.open(.o,4),.realtime)
  w "MLua calling overhead with    signal blocking: ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ set processtime=$$iterateCall(iterations,$&mlua.open(.o,16),.realtime)
+ w "MLua calling overhead with IO signal blocking: ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
  quit
 
 iterateCall(iterations,luaHandle,realtime)
@@ -159,6 +186,143 @@ iterateCall(iterations,luaHandle,realtime)
  do iterate(iterations,"do &mlua.lua("">math.abs"",.o,luaHandle,-1)")
  quit processtime
 
+; ~~~ Typed numeric call benchmarks
+
+benchmarkTypedCalls()
+ ; Compare passing numbers to Lua as strings with passing them as typed gtm_long_t and gtm_double_t parameters
+ new iterations,processtime,realtime,o,e
+ set iterations=100000
+ do lua(" function add(a,b) return a+b end ")
+ do sleep(1)
+ do iterate(iterations,"do &mlua.lua("">add"",.o,0,3,4)")
+ w "MLua integer add via string call: ",$select(hideProcess:"",1:$justify($fn(processtime*1000,",",1),7)),$select(hideProcess:"",1:"ns (process CPU time) "),$justify($fn(realtime*1000,",",1),7),"ns",$select(hideProcess:"",1:" (real time)"),!
+ do iterate(iterations,"do &mlua.long("">add"",.o,.e,0,3,4)")
+ w "MLua integer add via long call:   ",$select(hideProcess:"",1:$justify($fn(processtime*1000,",",1),7)),$select(hideProcess:"",1:"ns (process CPU time) "),$justify($fn(realtime*1000,",",1),7),"ns",$select(hideProcess:"",1:" (real time)"),!
+ do iterate(iterations,"do &mlua.lua("">add"",.o,0,3.5,0.25)")
+ w "MLua float add via string call:   ",$select(hideProcess:"",1:$justify($fn(processtime*1000,",",1),7)),$select(hideProcess:"",1:"ns (process CPU time) "),$justify($fn(realtime*1000,",",1),7),"ns",$select(hideProcess:"",1:" (real time)"),!
+ do iterate(iterations,"do &mlua.double("">add"",.o,.e,0,3.5,0.25)")
+ w "MLua float add via double call:   ",$select(hideProcess:"",1:$justify($fn(processtime*1000,",",1),7)),$select(hideProcess:"",1:"ns (process CPU time) "),$justify($fn(realtime*1000,",",1),7),"ns",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+; ~~~ Batch execution benchmarks
+
+benchmarkMap()
+ ; Compare calling a Lua function once per node from an M loop with applying it to all nodes using mlua.map()
+ new records,node,o,i,code
+ set records=10000
+ kill ^mapin,^mapout
+ for i=1:1:records set ^mapin(i)=$random(2147483646)
+ do lua(" function double(x) return x*2 end ")
+ set code="set node="""" for  set node=$order(^mapin(node)) quit:node=""""  do &mlua.lua("">double"",.o,0,^mapin(node)) set ^mapout(node)=o"
+ do minIterate(10,code)
+ w "M loop calling Lua for each of ",records," nodes in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ do minIterate(10,"do assert($&mlua.map("">double"",""^mapin"",""^mapout"",.o),records)")
+ w "mlua.map() applying Lua to all ",records," nodes in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ ; with a CPU-heavy function, mlua.pmap() spreads the work over worker threads
+ set code="local x=... for i=1,2000 do x=(x*31+i)%2147483647 end return x"
+ do minIterate(3,"do assert($&mlua.map(code,""^mapin"",""^mapout"",.o),records)")
+ w "mlua.map() of a heavy function over ",records," nodes in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ do minIterate(3,"do assert($&mlua.pmap(code,""^mapin"",""^mapout"",.o),records)")
+ w "mlua.pmap() of it in worker threads in   ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+benchmarkUpdates()
+ ; Compare Lua setting database nodes one by one through lua-yottadb with buffering them by mlua.set() for one transaction
+ new records,o
+ set records=10000
+ kill ^updout
+ do minIterate(10,"do &mlua.lua(""for v=1,""_records_"" do ydb.set('^updout',{v},v) end"",.o)")
+ w "Lua ydb.set() of ",records," nodes one by one in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ kill ^updout
+ do minIterate(10,"do &mlua.lua(""for v=1,""_records_"" do mlua.set({'^updout',v},v) end"",.o)")
+ do assert(^updout(records),records)
+ w "Lua mlua.set() of ",records," nodes in one flush in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ kill ^updout
+ quit
+
+benchmarkCoroutines()
+ ; Compare streaming values from a Lua generator with mlua.conext() against calling Lua once per value by index
+ new values,co,o,v
+ set values=10000
+ do lua(" function nth(i) return 'line '..i end  function lines(n) for i=1,n+0 do coroutine.yield('line '..i) end end ")
+ do minIterate(10,"for v=1:1:values do &mlua.lua("">nth"",.o,0,v)")
+ w "M loop calling Lua for each of ",values," values in ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ do minIterate(10,"set co=$&mlua.costart("">lines"",.o,0,values) for  quit:$&mlua.conext(co,.o)<0")
+ w "mlua.conext() streaming ",values," values in        ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+; ~~~ Budget benchmarks
+
+benchmarkBudget()
+ ; Measure the overhead of enforcing a call budget at several hook granularities
+ new handle,interval,i,o
+ set handle=$&mlua.open()
+ do assert($&mlua.lua(" function loop() local x=0 for i=1,1000000 do x=x+i end return x end ",.o,handle),0)
+ do minIterate(10,"do &mlua.lua("">loop"",.o,handle)")
+ w "Lua loop of 1M iterations without budget:               ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ for i=1:1:4 do
+ .set interval=$piece("100,1000,10000,100000",",",i)
+ .do assert($&mlua.budget(handle,0,60000000,interval),0)
+ .do minIterate(10,"do &mlua.lua("">loop"",.o,handle)")
+ .w "Lua loop of 1M iterations with budget check every ",$justify(interval,6),": ",$select(hideProcess:"",1:$justify($fn(processtime/1000,",",1),7)),$select(hideProcess:"",1:"ms (process CPU time) "),$justify($fn(realtime/1000,",",1),7),"ms",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+; ~~~ lua_State lifecycle benchmarks
+
+benchmarkStates()
+ ; Compare the cost of opening and closing lua_States with resetting them and getting them from the pool
+ new iterations,handle,o
+ set iterations=1000
+ do iterate(iterations,"set handle=$&mlua.open(.o) do assert($&mlua.close(handle),0)")
+ w "lua_State open+close:   ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ set handle=$&mlua.open(.o,256)
+ do iterate(iterations,"do assert($&mlua.lua(""x=1"",.o,handle),0) do assert($&mlua.reset(handle),0)")
+ w "lua_State call+reset:   ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ do assert($&mlua.close(handle),0)
+ do assert($&mlua.poolfill(1,.o),1)
+ do iterate(iterations,"set handle=$&mlua.poolget(.o) do assert($&mlua.poolput(handle),0)")
+ w "lua_State pool get+put: ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+benchmarkLibs()
+ ; Compare the cost of opening lua_States with all standard libraries, selected libraries, and lazily-opened libraries
+ new iterations,handle,o
+ set iterations=1000
+ do iterate(iterations,"set handle=$&mlua.open(.o) do assert($&mlua.close(handle),0)")
+ w "lua_State open all libs:  ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ do iterate(iterations,"set handle=$&mlua.open(.o,0,0,""string,table"") do assert($&mlua.close(handle),0)")
+ w "lua_State open 2 libs:    ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ do iterate(iterations,"set handle=$&mlua.open(.o,512,0,""string,table"") do assert($&mlua.close(handle),0)")
+ w "lua_State open lazy libs: ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+benchmarkWorkers()
+ ; Compare running CPU-heavy Lua jobs one after another in M's lua_State with running them at once in worker threads
+ new iterations,jobs,i,job,o,code
+ set iterations=10,jobs=4
+ set code="local n=0 for i=1,3000000 do n=(n+i*i)%1000003 end return n"
+ do iterate(iterations,"for job=1:1:jobs do assert($&mlua.lua(code,.o),0)")
+ w "Lua jobs one at a time:   ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ do iterate(iterations,"for job=1:1:jobs set job(job)=$&mlua.submit(code,.o) for job=1:1:jobs do assert($&mlua.wait(job(job),.o),0)")
+ w "Lua jobs in "_jobs_" workers:   ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ quit
+
+benchmarkBytecodeCache()
+ ; Compare the cost of require() in a new lua_State with and without the bytecode cache
+ new iterations,handle,o,dir,code
+ set iterations=200
+ do assert($&mlua.lua("dir=os.tmpname() os.remove(dir) os.execute('mkdir -p '..dir..'/cache') return dir",.dir),0)
+ do assert($&mlua.lua("local f=io.open('"_dir_"/benchmod.lua','w') for i=1,2000 do f:write('local function f'..i..'(a,b) return a+b*'..i..' end\n') end f:write('return {}') f:close()",.o),0)
+ set code="set handle=$&mlua.open(.o) do assert($&mlua.lua(""package.path='"_dir_"/?.lua' require'benchmod'"",.o,handle),0) do assert($&mlua.close(handle),0)"
+ do iterate(iterations,code)
+ w "require uncached:         ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ view "SETENV":"MLUA_BYTECODE_CACHE":dir_"/cache"
+ do iterate(iterations,code)
+ w "require bytecode cached:  ",$select(hideProcess:"",1:$justify($fn(processtime,",",1),7)),$select(hideProcess:"",1:"us (process CPU time) "),$justify($fn(realtime,",",1),7),"us",$select(hideProcess:"",1:" (real time)"),!
+ view "UNSETENV":"MLUA_BYTECODE_CACHE"
+ do assert($&mlua.lua("os.execute('rm -rf "_dir_"')",.o),0)
+ quit
+
 
 benchmarkStringProcesses()
  new expect10,expect1k,expect1m
@@ -0,0 +1,136 @@
+// Lua for MUMPS metrics monitor
+
+// Display the metrics that MLua processes publish to the shared metrics file named by MLUA_METRICS (see mlua_metrics.h)
+// Usage: mlua-top [-1] [metrics_file] [interval_seconds]
+//    metrics_file defaults to $MLUA_METRICS; interval defaults to 2 seconds; -1 prints the metrics once and exits
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mlua_metrics.h"
+
+// Copy a slot out of the shared file, retrying while its writer is part-way through updating it
+// return false if the slot is unused or its process has exited
+static bool read_slot(metrics_slot_t *slot, metrics_slot_t *copy) {
+  uint32_t seq;
+  do {
+    do
+      seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    while (seq & 1);
+    copy->pid = atomic_load_explicit(&slot->pid, memory_order_relaxed);
+    copy->calls = slot->calls;
+    copy->errors = slot->errors;
+    copy->run_ns = slot->run_ns;
+    memcpy(copy->histogram, slot->histogram, sizeof(copy->histogram));
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
+  int32_t pid = copy->pid;
+  return pid && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// Return the latency in microseconds below which `percentile` percent of the calls in histogram fall
+static uint64_t percentile_us(const uint64_t *histogram, double percentile) {
+  uint64_t total = 0, count = 0;
+  for (int i=0; i<METRICS_BUCKETS; i++)
+    total += histogram[i];
+  if (!total)
+    return 0;
+  for (int i=0; i<METRICS_BUCKETS; i++) {
+    count += histogram[i];
+    if (count >= total*percentile/100)
+      return (uint64_t)1 << i;  // upper bound of bucket i
+  }
+  return (uint64_t)1 << (METRICS_BUCKETS-1);
+}
+
+// Print one line of metrics, with call rate since `previous` (if not NULL) over `seconds`
+static void print_metrics(const char *name, const metrics_slot_t *slot, const metrics_slot_t *previous, double seconds) {
+  double rate = previous && seconds>0? ((double)slot->calls - (double)previous->calls)/seconds: 0;
+  printf("%10s %14llu %10llu %12.1f %12.1f %10llu %10llu\n", name,
+    (unsigned long long)slot->calls, (unsigned long long)slot->errors, rate,
+    slot->calls? slot->run_ns/1000.0/slot->calls: 0.0,
+    (unsigned long long)percentile_us(slot->histogram, 50), (unsigned long long)percentile_us(slot->histogram, 99));
+}
+
+int main(int argc, char **argv) {
+  bool once = false;
+  if (argc > 1 && !strcmp(argv[1], "-1"))
+    once = true, argc--, argv++;
+  char *filename = argc > 1? argv[1]: getenv("MLUA_METRICS");
+  double interval = argc > 2? atof(argv[2]): 2;
+  if (!filename || !*filename || interval <= 0) {
+    fprintf(stderr, "Usage: mlua-top [-1] [metrics_file] [interval_seconds]\n"
+                    "metrics_file defaults to $MLUA_METRICS\n");
+    return 2;
+  }
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < METRICS_FILE_SIZE) {
+    fprintf(stderr, "%s: not an MLua metrics file\n", filename);
+    return 1;
+  }
+  metrics_file_t *file = mmap(NULL, METRICS_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    perror(filename);
+    return 1;
+  }
+  if (file->magic != METRICS_MAGIC || file->version != METRICS_VERSION || file->slots != METRICS_SLOTS) {
+    fprintf(stderr, "%s: not an MLua metrics file of version %d\n", filename, METRICS_VERSION);
+    return 1;
+  }
+
+  static metrics_slot_t previous[METRICS_SLOTS], current[METRICS_SLOTS];
+  metrics_slot_t previous_total = {0};
+  bool have_previous = false;
+  while (true) {
+    metrics_slot_t total = {0};
+    int processes = 0;
+    if (!once)
+      printf("\033[H\033[J");  // clear screen
+    printf("%10s %14s %10s %12s %12s %10s %10s\n", "PID", "CALLS", "ERRORS", "CALLS/SEC", "AVG_US", "P50_US", "P99_US");
+    for (int i=0; i<METRICS_SLOTS; i++) {
+      if (!read_slot(&file->slot[i], &current[i])) {
+        current[i].pid = 0;
+        continue;
+      }
+      processes++;
+      total.calls += current[i].calls;
+      total.errors += current[i].errors;
+      total.run_ns += current[i].run_ns;
+      for (int b=0; b<METRICS_BUCKETS; b++)
+        total.histogram[b] += current[i].histogram[b];
+      char name[16];
+      snprintf(name, sizeof(name), "%d", (int)current[i].pid);
+      bool same_process = have_previous && previous[i].pid == current[i].pid;
+      print_metrics(name, &current[i], same_process? &previous[i]: NULL, interval);
+    }
+    print_metrics("TOTAL", &total, have_previous? &previous_total: NULL, interval);
+    printf("%d processes\n", processes);
+    fflush(stdout);
+    if (once)
+      break;
+    memcpy(previous, current, sizeof(previous));
+    previous_total = total;
+    have_previous = true;
+    struct timespec delay = {(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+    nanosleep(&delay, NULL);
+  }
+  munmap(file, METRICS_FILE_SIZE);
+  return 0;
+}
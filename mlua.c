@@ -2,6 +2,8 @@
 
 // Make sure signal.h imports the stuff we need
 #define _POSIX_C_SOURCE 200809L
+// Make sure sys/mman.h imports MAP_ANONYMOUS and madvise() for huge page allocation
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stddef.h>
@@ -10,33 +12,174 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "gtmxc_types.h"
+#include "libyottadb.h"
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
+#ifdef LUA_JITLIBNAME
+  #include "luajit.h"
+#endif
 
 // Enable build against Lua older than 5.3
 #include "compat-5.3.h"
 
 #include "mlua.h"
+#include "mlua_metrics.h"
 
 #define DEFAULT_OUTPUT stdout
 
-// If lua-yottadb ever changes to call ydb with threading calls, change the following to pthread_sigmask() and compile+link with -pthread option,
+// Use pthread_sigmask() since mlua_submit() starts worker threads, in whose presence sigprocmask() is unspecified
+// Only the main thread runs YDB and the lua_States in State_array, so blocking its signals is still what matters,
 // cf. main documentation README.me on Thread Safety
-#define SIGPROCMASK(how,set,oldset) sigprocmask((how),(set),(oldset))
+#define SIGPROCMASK(how,set,oldset) pthread_sigmask((how),(set),(oldset))
 // List of signals that YDB can trigger which we don't interrupting MLua slow IO reads/writes
 // Note that SIGALRM is handled separately so is not listed here
 #define BLOCKED_SIGNALS SIGCHLD, SIGTSTP, SIGTTIN, SIGTTOU, SIGCONT, SIGUSR1, SIGUSR2
 
+// Maximum number of compiled code strings cached per lua_State; least recently used code is evicted when full
+#define CODE_CACHE_SIZE 64
+
+// define the struct of an entry in the cache of compiled code strings
+typedef struct cache_entry_t {
+  uint64_t hash;  // hash of the code string, or 0 if this entry is unused
+  char *code;  // malloc'ed copy of the code string used to confirm a hash match
+  size_t length;  // length of code string
+  int ref;  // Lua registry reference to the compiled function
+  unsigned long last_used;  // cache clock value when this entry was last used, for LRU eviction
+} cache_entry_t;
+
+// define the struct of a large result string being streamed to M in chunks by mlua_fetch()
+typedef struct pinned_result_t {
+  const char *data;  // points directly into the Lua string, which is pinned in the registry; NULL if this id is unused
+  size_t length;  // length of the string
+  size_t offset;  // how much of the string has already been returned to M
+} pinned_result_t;
+
+#define RESULT_ARRAY_LUMPS 10 /* increment the result array in lumps of this many results */
+
+// define the struct of a large input argument being streamed into Lua in chunks by mlua_append()
+typedef struct input_buffer_t {
+  char *data;  // malloc'ed buffer; NULL if this buffer id is unused
+  size_t length;  // bytes of data stored
+  size_t size;  // bytes allocated; doubled whenever more space is needed so that appending is not quadratic
+} input_buffer_t;
+
+#define BUFFER_ARRAY_LUMPS 10 /* increment the buffer array in lumps of this many buffers */
+#define BUFFER_INITIAL_SIZE 65536 /* minimum number of bytes to allocate for a new input buffer */
+
+// Lua allocator that keeps small objects in per-lua_State pools, used by lua_States opened with MLUA_POOL_ALLOC
+// Lua's small objects (strings, tables, closures) are carved out of slabs and recycled through per-size-class free lists
+// so that a long-running process does not fragment the malloc heap that it shares with YDB
+#define POOL_CLASS_SIZE 16 /* pool size classes are multiples of this many bytes, which also ensures alignment */
+#define POOL_CLASSES 16 /* so allocations up to POOL_CLASSES*POOL_CLASS_SIZE (256) bytes are pooled; larger ones use malloc */
+#define POOL_SLAB_SIZE 65536 /* bytes per slab allocated to the pools */
+#define HUGE_PAGE_SIZE (2*1024*1024) /* size and alignment of slabs for lua_States opened with MLUA_HUGE_PAGES */
+
+// header at the start of each slab, so that slabs can be freed when the lua_State is closed
+typedef struct pool_slab_t {
+  struct pool_slab_t *next;
+  size_t size;
+  bool mapped;  // slab was allocated with mmap() rather than malloc()
+  char padding[POOL_CLASS_SIZE - (sizeof(void*)+sizeof(size_t)+sizeof(bool)) % POOL_CLASS_SIZE];  // keep blocks aligned
+} pool_slab_t;
+
+// define the struct that Lua passes to mlua_alloc() -- malloc'ed separately so it does not move when State_array is realloc'ed
+typedef struct allocator_t {
+  bool pooled;  // allocate small objects from pools rather than malloc
+  bool huge_pages;  // back pool slabs with transparent huge pages
+  size_t in_use, peak;  // bytes allocated by Lua now and at most
+  size_t limit;  // maximum bytes Lua may allocate, or 0 for no limit
+  int protected_calls;  // number of limited_pcall()s in progress: the limit is only enforced within them
+  void *free_lists[POOL_CLASSES];  // singly-linked list of free blocks in each size class
+  size_t blocks_used[POOL_CLASSES];  // number of blocks allocated to Lua in each size class
+  size_t blocks_free;  // number of blocks in all free_lists
+  char *slab_next, *slab_end;  // unused space at the end of the most recently allocated slab
+  pool_slab_t *slabs;  // linked list of all slabs
+  size_t slab_bytes;  // total size of all slabs
+} allocator_t;
+
+// Limits on the Lua instructions and real time a single call into Lua may use, set by mlua_budget()
+#define BUDGET_INTERVAL 1000 /* default number of Lua instructions between budget checks */
+typedef struct budget_t {
+  gtm_long_t instructions;  // maximum number of Lua VM instructions per call, or 0 for no limit
+  gtm_long_t microseconds;  // maximum real time per call, or 0 for no limit
+  gtm_int_t interval;  // number of Lua instructions between checks of the budget
+} budget_t;
+
+// Budget of a call into Lua that is currently running; lives on the C stack of the caller for the duration of the call
+typedef struct call_budget_t {
+  gtm_long_t remaining;  // instructions remaining, if instructions are limited
+  bool limit_instructions;
+  gtm_long_t deadline;  // mlua_nanoseconds() time at which the call must end, or 0 for no time limit
+  int interval;  // number of instructions between budget checks
+  const void *registry;  // registry of the budgeted lua_State, which identifies it in count_hook() from any of its threads
+  struct profile_t *profile;  // profiler of the budgeted lua_State, if it is being profiled
+  bool exceeded;
+  struct call_budget_t *outer;  // budget of the enclosing call, if Lua called M which called Lua again
+  lua_Hook outer_hook;  // hook to restore when this call ends
+  int outer_mask, outer_count;
+} call_budget_t;
+
+// Counters of the work done by a lua_State, returned by mlua_stats(); plain increments so they can always be left on
+// times are only measured for lua_States opened with MLUA_TIME_CALLS, to avoid calling the clock on every call
+typedef struct call_stats_t {
+  uint64_t calls;  // calls into Lua code
+  uint64_t errors;  // calls that returned an error
+  uint64_t compiles;  // code strings compiled (i.e. not found in the code cache)
+  uint64_t compile_ns;  // time spent compiling code strings
+  uint64_t run_ns;  // time spent running Lua code
+  uint64_t signal_ns;  // time spent blocking and unblocking signals around calls
+  uint64_t bytes_in;  // bytes of string parameters passed into Lua
+  uint64_t bytes_out;  // bytes of results returned to M
+  uint64_t truncations;  // results truncated to fit the output string
+} call_stats_t;
+
+// Sampling profiler of a lua_State, started by mlua_profile()
+// Lives in a Lua userdata in the lua_State's registry so that count_hook() can find it from any of the lua_State's threads
+#define PROFILE_MAX_DEPTH 100 /* maximum number of stack frames recorded per sample */
+#define PROFILE_FRAME_SIZE 256 /* maximum length of the description of one stack frame */
+typedef struct profile_t {
+  int interval;  // number of Lua instructions between samples
+  int countdown;  // instructions left before the next sample
+  int stacks_ref;  // Lua registry reference to table of sample counts indexed by folded stack string
+} profile_t;
+
 // define the struct of State array  elements
 typedef struct mlua_state_t {
   lua_State *luastate;
   gtm_int_t flags;  // flags passed in to mlua_open()
   sigset_t sigmask;  // mlua_open() sets this to the YDB signals we must block while Lua code runs
   struct sigaction sigalrm_action;  // flags used to set sigaction on SIGALRM - store to save one OS call every invokation of Lua
+  cache_entry_t cache[CODE_CACHE_SIZE];  // cache of compiled code strings so that repeated code skips the compiler
+  unsigned long cache_clock;  // incremented on every cache lookup to timestamp entries
+  unsigned long cache_hits, cache_misses;
+  int prepared_ref;  // Lua registry reference to the table of functions prepared by mlua_prepare(), or 0 if none yet
+  int coroutines_ref;  // Lua registry reference to the table of coroutines started by mlua_co_start(), or 0 if none yet
+  int results_ref;  // Lua registry reference to the table of pinned result strings being streamed by mlua_fetch(), or 0 if none yet
+  int results_size;  // number of elements allocated in `results`
+  struct pinned_result_t *results;  // array of result strings being streamed, indexed by result id-1
+  int buffers_size;  // number of elements allocated in `buffers`
+  struct input_buffer_t *buffers;  // array of input buffers being appended to by mlua_append(), indexed by buffer id-1
+  struct allocator_t *allocator;  // memory allocator and statistics of this lua_State, or NULL if Lua could not use it
+  budget_t budget;  // budget of every call into this lua_State; all zero for no budget
+  budget_t next_budget;  // budget that overrides `budget` for the next call only, if next_budget_set
+  bool next_budget_set;
+  call_stats_t stats;  // counters returned by mlua_stats()
+  struct profile_t *profile;  // profiler started by mlua_profile(), or NULL if not profiling; memory belongs to Lua
+  int baseline_ref;  // Lua registry reference to the snapshot that mlua_reset() restores, or 0 if not opened with MLUA_RESETTABLE
+  bool pooled;  // lua_State is parked in the pool of states, ready for mlua_pool_get() to hand out
+  bool from_pool;  // lua_State was opened by mlua_pool_get() or mlua_pool_fill(), so mlua_pool_put() may take it back
+  bool jit_off, jit_was_on;  // update_jit() has switched LuaJIT's JIT compiler off, and whether it was on before
 } mlua_state_t;
 
 // Declare struct of header and array used to store list of open states
@@ -48,6 +191,16 @@ typedef struct state_array_t {
 
 #define STATE_ARRAY_LUMPS 10 /* increment the state array in lumps of this many states */
 state_array_t *State_array = NULL;
+// Budget of the innermost call into Lua that has a budget, or NULL if none
+static call_budget_t *Active_budget = NULL;
+// Counters of lua_States that have been closed, so that mlua_stats() can report totals for the whole process
+static call_stats_t Closed_stats;
+// This process's slot in the shared metrics file named by environment variable MLUA_METRICS, or NULL if not publishing
+static metrics_file_t *Metrics_file = NULL;
+static metrics_slot_t *Metrics_slot = NULL;
+static pid_t Metrics_pid;  // process that claimed Metrics_slot, or 0 in a forked child, which must claim its own
+// Number of chunks this process has loaded from the bytecode cache rather than compiled, reported by mlua_stats(-1)
+static uint64_t Bytecode_hits = 0;
 
 
 // like printf but fills gtm_string_t with up to maximum size
@@ -73,12 +226,183 @@ int outputf(gtm_string_t *output, int output_size, const char *fmt, ...) {
   return 0;
 }
 
+// Return whether the file or directory with status `st` belongs to this process's user and is writable by no one else
+// MLua maps or loads bytecode from such files, which Lua runs unverified, so must not trust files that others could change
+static bool private_to_user(const struct stat *st) {
+  return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP|S_IWOTH));
+}
+
 // Wrap luaL_openlibs to change it to type lua_CFunction so we can call it with protected pcall
 static int luaL_openlibs_ret0(lua_State *L) {
   luaL_openlibs(L);
   return 0; // return no parameters
 }
 
+// Standard Lua libraries that mlua_open() can select, as luaL_openlibs() opens them
+// The base library and package library are always opened, since the others are loaded through package
+static const luaL_Reg Lua_libs[] = {
+  {LUA_TABLIBNAME, luaopen_table},
+  {LUA_STRLIBNAME, luaopen_string},
+  {LUA_MATHLIBNAME, luaopen_math},
+  {LUA_IOLIBNAME, luaopen_io},
+  {LUA_OSLIBNAME, luaopen_os},
+  {LUA_DBLIBNAME, luaopen_debug},
+#if LUA_VERSION_NUM >= 502
+  {LUA_COLIBNAME, luaopen_coroutine},  // part of the base library in Lua 5.1
+#endif
+#ifdef LUA_UTF8LIBNAME
+  {LUA_UTF8LIBNAME, luaopen_utf8},
+#endif
+#if defined(LUA_BITLIBNAME) && LUA_VERSION_NUM == 502
+  {LUA_BITLIBNAME, luaopen_bit32},
+#endif
+#ifdef LUA_JITLIBNAME  // LuaJIT
+  {LUA_BITLIBNAME, luaopen_bit},
+  {LUA_JITLIBNAME, luaopen_jit},
+  {LUA_FFILIBNAME, luaopen_ffi},
+#endif
+  {NULL, NULL}
+};
+
+// Globals __index metamethod for lua_States opened with MLUA_LAZY_LIBS: open a library on first access to its global name
+// Its upvalue is a table of the library open functions indexed by library name
+static int open_lazy_lib(lua_State *L) {
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));
+  if (!lua_iscfunction(L, -1) || lua_type(L, 2) != LUA_TSTRING)
+    return 0;  // not a library, so the global is nil as usual
+  // the library stays in the lazy table so that it can be opened again if mlua_reset() removes it
+  luaL_requiref(L, lua_tostring(L, 2), lua_tocfunction(L, -1), 1);
+  return 1;
+}
+
+// Open the base and package libraries, and the libraries named in comma-separated list `libs` (first parameter)
+// If `lazy` (second parameter) is true, make the unlisted libraries open on first use: both by require() and by accessing their global
+// If `libs` lists an unknown library, raise an error
+// Lua C function so that it can be called with protected pcall
+static int open_selected_libs(lua_State *L) {
+  size_t len;
+  const char *libs = luaL_checklstring(L, 1, &len);
+  bool lazy = lua_toboolean(L, 2);
+  // check that every listed library name is known
+  for (const char *name=libs, *end; name < libs+len; name=end+1) {
+    end = memchr(name, ',', libs+len-name);
+    if (!end) end = libs+len;
+    const luaL_Reg *lib;
+    for (lib=Lua_libs; lib->name; lib++)
+      if (strlen(lib->name) == end-name && !memcmp(lib->name, name, end-name))
+        break;
+    if (!lib->name && end > name) {
+      lua_pushlstring(L, name, end-name);
+      luaL_error(L, "unknown library '%s'", lua_tostring(L, -1));
+    }
+  }
+  luaL_requiref(L, "_G", luaopen_base, 1);
+  luaL_requiref(L, LUA_LOADLIBNAME, luaopen_package, 1);
+  lua_pop(L, 2);
+  lua_newtable(L);  // table of lazy libraries
+  int lazy_libs = lua_gettop(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, LUA_LOADLIBNAME);
+  lua_getfield(L, -1, "preload");
+  int preload = lua_gettop(L);
+  for (const luaL_Reg *lib=Lua_libs; lib->name; lib++) {
+    size_t namelen = strlen(lib->name);
+    const char *found = libs;
+    while ((found = strstr(found, lib->name)) && ((found>libs && found[-1]!=',') || (found[namelen] && found[namelen]!=',')))
+      found += namelen;
+    if (found)
+      luaL_requiref(L, lib->name, lib->func, 1), lua_pop(L, 1);
+    else if (lazy) {
+      lua_pushcfunction(L, lib->func);
+      lua_setfield(L, preload, lib->name);
+      lua_pushcfunction(L, lib->func);
+      lua_setfield(L, lazy_libs, lib->name);
+    }
+  }
+  if (lazy) {
+    lua_pushglobaltable(L);
+    lua_newtable(L);  // metatable for globals
+    lua_pushvalue(L, lazy_libs);
+    lua_pushcclosure(L, open_lazy_lib, 1);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+  }
+  return 0;  // return no parameters
+}
+
+// Signal mask and SIGALRM action used by io_signal_wrapper() for lua_States opened with MLUA_BLOCK_IO_SIGNALS
+// These are process-wide (set by mlua_open()) because the wrapped functions are closures that cannot locate their mlua_state_t
+static sigset_t IO_sigmask;
+static struct sigaction IO_sigalrm_action;
+
+// Lua C closure that calls its upvalue (a Lua IO function) with YDB signals blocked so that its slow IO is not interrupted
+// Used by lua_States opened with MLUA_BLOCK_IO_SIGNALS so that only IO (rather than every Lua call) pays for signal blocking
+static int io_signal_wrapper(lua_State *L) {
+  int args = lua_gettop(L);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  sigset_t oldmask;
+  struct sigaction action = IO_sigalrm_action;
+  action.sa_flags |= SA_RESTART;
+  SIGPROCMASK(SIG_BLOCK, &IO_sigmask, &oldmask);
+  sigaction(SIGALRM, &action, NULL);
+  // use pcall so that signals are always unblocked, even on error
+  int error = lua_pcall(L, args, LUA_MULTRET, 0);
+  sigaction(SIGALRM, &IO_sigalrm_action, NULL);
+  SIGPROCMASK(SIG_SETMASK, &oldmask, NULL);
+  if (error)
+    return lua_error(L);
+  // wrap any returned iterator functions, e.g. from io.lines(), so that their reads also block signals
+  int results = lua_gettop(L);
+  for (int i=1; i<=results; i++) {
+    if (lua_type(L, i) == LUA_TFUNCTION) {
+      lua_pushvalue(L, i);
+      lua_pushcclosure(L, io_signal_wrapper, 1);
+      lua_replace(L, i);
+    }
+  }
+  return results;
+}
+
+// Replace each named function in the table at `index` with a closure that calls it with YDB signals blocked
+static void wrap_io_functions(lua_State *L, int index, const char *const names[]) {
+  index = lua_absindex(L, index);
+  for (; *names; names++) {
+    lua_getfield(L, index, *names);
+    if (lua_type(L, -1) == LUA_TFUNCTION) {
+      lua_pushcclosure(L, io_signal_wrapper, 1);
+      lua_setfield(L, index, *names);
+    } else
+      lua_pop(L, 1);
+  }
+}
+
+// Wrap the Lua library functions that do slow IO so that they block YDB signals; for lua_States opened with MLUA_BLOCK_IO_SIGNALS
+// Lua C function so that it can be called with protected pcall
+static int wrap_io_libs(lua_State *L) {
+  static const char *const io_functions[] = {"close", "flush", "input", "lines", "open", "output", "popen", "read", "write", NULL};
+  static const char *const file_methods[] = {"close", "flush", "lines", "read", "seek", "setvbuf", "write", NULL};
+  static const char *const os_functions[] = {"execute", "remove", "rename", "tmpname", NULL};
+  static const char *const base_functions[] = {"print", NULL};
+  lua_getglobal(L, "io");
+  if (lua_type(L, -1) == LUA_TTABLE)
+    wrap_io_functions(L, -1, io_functions);
+  lua_getglobal(L, "os");
+  if (lua_type(L, -1) == LUA_TTABLE)
+    wrap_io_functions(L, -1, os_functions);
+  lua_pushglobaltable(L);
+  wrap_io_functions(L, -1, base_functions);
+  // file methods are in the FILE* metatable's __index table (which is the metatable itself in Lua <5.4)
+  luaL_getmetatable(L, LUA_FILEHANDLE);
+  if (lua_type(L, -1) == LUA_TTABLE) {
+    lua_getfield(L, -1, "__index");
+    if (lua_type(L, -1) == LUA_TTABLE)
+      wrap_io_functions(L, -1, file_methods);
+  }
+  return 0;  // return no parameters
+}
+
 // Return version numbers for this module
 gtm_int_t mlua_version_number(int _argc) {
   return MLUA_VERSION_NUMBER;
@@ -112,10 +436,253 @@ gtm_long_t mlua_nanoseconds(int argc, gtm_int_t process) {
   return tp.tv_nsec + (gtm_long_t)tp.tv_sec*1000000000L;
 }
 
+// Claim a free slot in Metrics_file for this process, or a slot left behind by a process that has exited
+// set Metrics_slot to NULL if there is no slot free
+static void claim_metrics_slot(void) {
+  Metrics_pid = getpid();
+  Metrics_slot = NULL;
+  for (uint32_t i=0; i<Metrics_file->slots; i++) {
+    metrics_slot_t *slot = &Metrics_file->slot[i];
+    int32_t pid = atomic_load(&slot->pid);
+    if (pid && (pid == Metrics_pid || kill(pid, 0) == 0 || errno != ESRCH))
+      continue;
+    if (!atomic_compare_exchange_strong(&slot->pid, &pid, Metrics_pid))
+      continue;  // another process claimed it first
+    atomic_fetch_add(&slot->seq, 1);
+    memset(&slot->calls, 0, sizeof(metrics_slot_t) - offsetof(metrics_slot_t, calls));
+    atomic_fetch_add(&slot->seq, 1);
+    Metrics_slot = slot;
+    return;
+  }
+}
+
+// pthread_atfork() child handler that makes a forked child claim its own metrics slot rather than write to its parent's
+static void forget_metrics_slot(void) {
+  Metrics_pid = 0;
+  Metrics_slot = NULL;
+}
+
+// Map the shared metrics file named by environment variable MLUA_METRICS, if set, and claim a slot in it for this process
+// As for the code store, the file must belong to the user and be writable by no one else, since every process writes to it
+// Metrics are optional, so on any failure just don't publish them
+static void open_metrics(void) {
+  char *filename = getenv("MLUA_METRICS");
+  if (!filename || !*filename)
+    return;
+  int fd = open(filename, O_RDWR|O_CREAT|O_NOFOLLOW, 0644);  // readable by mlua-top run as any user
+  if (fd < 0)
+    return;
+  struct stat st;
+  metrics_file_t *file = MAP_FAILED;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && private_to_user(&st)
+      && (st.st_size >= METRICS_FILE_SIZE || !ftruncate(fd, METRICS_FILE_SIZE)))
+    file = mmap(NULL, METRICS_FILE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED)
+    return;
+  // a new file is all zeros; concurrent initializers write identical values so need no lock
+  if (file->magic != METRICS_MAGIC) {
+    file->version = METRICS_VERSION;
+    file->slots = METRICS_SLOTS;
+    atomic_thread_fence(memory_order_release);
+    file->magic = METRICS_MAGIC;
+  }
+  if (file->version != METRICS_VERSION || file->slots != METRICS_SLOTS) {
+    munmap(file, METRICS_FILE_SIZE);
+    return;
+  }
+  Metrics_file = file;
+  claim_metrics_slot();
+  pthread_atfork(NULL, NULL, forget_metrics_slot);
+}
+
+// Publish one call into Lua that took `ns` nanoseconds to this process's slot in the shared metrics file
+static void publish_metrics(bool error, gtm_long_t ns) {
+  if (!Metrics_pid)
+    claim_metrics_slot();  // we are a forked child, so must not write to our parent's slot
+  metrics_slot_t *slot = Metrics_slot;
+  if (!slot)
+    return;
+  int bucket = 0;
+  for (uint64_t us=ns/1000; us && bucket<METRICS_BUCKETS-1; us>>=1)
+    bucket++;
+  atomic_fetch_add_explicit(&slot->seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->calls++;
+  slot->errors += error;
+  slot->run_ns += ns;
+  slot->histogram[bucket]++;
+  atomic_fetch_add_explicit(&slot->seq, 1, memory_order_release);
+}
+
+// Identify the Lua that compiled cached or shared bytecode: LuaJIT's differs from Lua 5.1's though both have LUA_RELEASE 5.1
+#ifdef LUA_JITLIBNAME
+  #define BYTECODE_RELEASE LUA_RELEASE " LuaJIT"
+#else
+  #define BYTECODE_RELEASE LUA_RELEASE
+#endif
+
+// Store of compiled code strings shared by all processes on the host, in a file named by environment variable MLUA_CODE_STORE
+// load_code() looks code strings up here before compiling them and adds the ones it compiles, so that each code string is
+// compiled once per host rather than once per process. The store is append-only and simply stops growing when full.
+// Its file size is set by MLUA_CODE_STORE_SIZE when created, and all processes must use the same size.
+// Since it holds bytecode that processes run unverified, the file must belong to the user and be writable by no one else.
+
+#define CODE_STORE_MAGIC 0x45524f5453554c4dULL  /* "MLUSTORE" in little-endian byte order */
+#define CODE_STORE_VERSION 1
+#define CODE_STORE_SLOTS 65536  /* number of slots in the hash index; must be a power of 2 */
+#define CODE_STORE_PROBES 32  /* maximum number of index slots searched for a code string */
+#define CODE_STORE_DEFAULT_SIZE (64*1024*1024)  /* file size if MLUA_CODE_STORE_SIZE is not set */
+
+// Entry of the code store: followed by the code string then its bytecode, padded to 8-byte alignment
+typedef struct code_store_entry_t {
+  uint64_t hash;  // hash_code() of the code string
+  uint32_t code_length;
+  uint32_t bytecode_length;
+  char data[];
+} code_store_entry_t;
+
+// Layout of the whole code store file
+typedef struct code_store_t {
+  uint64_t magic;  // CODE_STORE_MAGIC once the file is initialized
+  uint32_t version;  // CODE_STORE_VERSION
+  uint32_t slots;  // CODE_STORE_SLOTS
+  char release[32];  // BYTECODE_RELEASE of the Lua that compiled the bytecode
+  uint64_t size;  // size of the file
+  _Atomic uint64_t used;  // offset at which to append the next entry, or 0 before the file is initialized
+  _Atomic uint64_t index[CODE_STORE_SLOTS];  // offset of the entry in each hash slot, or 0 if the slot is empty
+} code_store_t;
+
+static code_store_t *Code_store;  // mapped code store, or NULL if MLUA_CODE_STORE is not in use
+
+// Map the shared code store named by environment variable MLUA_CODE_STORE, if set
+// The store is optional, so on any failure just compile every code string as usual
+static void open_code_store(void) {
+  char *filename = getenv("MLUA_CODE_STORE");
+  if (!filename || !*filename)
+    return;
+  char *size_string = getenv("MLUA_CODE_STORE_SIZE");
+  uint64_t size = size_string && *size_string? strtoull(size_string, NULL, 0): CODE_STORE_DEFAULT_SIZE;
+  int fd = open(filename, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return;
+  struct stat st;
+  code_store_t *store = MAP_FAILED;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && private_to_user(&st)
+      && size >= sizeof(code_store_t) && (st.st_size == size || (!st.st_size && !ftruncate(fd, size))))
+    store = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (store == MAP_FAILED)
+    return;
+  // a new file is all zeros; concurrent initializers write identical values, and only the first one sets `used`
+  if (store->magic != CODE_STORE_MAGIC) {
+    store->version = CODE_STORE_VERSION;
+    store->slots = CODE_STORE_SLOTS;
+    strncpy(store->release, BYTECODE_RELEASE, sizeof(store->release)-1);
+    store->size = size;
+    uint64_t unused = 0;
+    atomic_compare_exchange_strong(&store->used, &unused, sizeof(code_store_t));
+    atomic_thread_fence(memory_order_release);
+    store->magic = CODE_STORE_MAGIC;
+  }
+  if (store->version != CODE_STORE_VERSION || store->slots != CODE_STORE_SLOTS || store->size != size
+      || strncmp(store->release, BYTECODE_RELEASE, sizeof(store->release)-1)) {
+    munmap(store, size);
+    return;
+  }
+  Code_store = store;
+}
+
+// Return the entry at `offset` in the code store, or NULL if the offset or the entry's lengths run past the end of the store
+static code_store_entry_t *stored_entry(code_store_t *store, uint64_t offset) {
+  if (offset < sizeof(code_store_t) || offset > store->size || store->size-offset < sizeof(code_store_entry_t))
+    return NULL;
+  code_store_entry_t *entry = (code_store_entry_t *)((char *)store + offset);
+  uint64_t room = store->size - offset - sizeof(code_store_entry_t);
+  if ((uint64_t)entry->code_length + entry->bytecode_length > room)
+    return NULL;
+  return entry;
+}
+
+// Push the function compiled from code string `code` of `length` bytes with hash `hash` from the shared code store
+// return true on success, or false, having pushed nothing, if it is not in the store
+static bool load_stored_code(lua_State *L, const char *code, size_t length, uint64_t hash) {
+  code_store_t *store = Code_store;
+  for (int probe=0; probe<CODE_STORE_PROBES; probe++) {
+    uint64_t offset = atomic_load_explicit(&store->index[(hash+probe) & (CODE_STORE_SLOTS-1)], memory_order_acquire);
+    if (!offset)
+      return false;
+    code_store_entry_t *entry = stored_entry(store, offset);
+    if (!entry)
+      return false;
+    if (entry->hash != hash || entry->code_length != length || memcmp(entry->data, code, length))
+      continue;
+    if (!luaL_loadbufferx(L, entry->data+length, entry->bytecode_length, "mlua(code)", "b"))
+      return true;
+    lua_pop(L, 1);  // pop error message: bytecode was not loadable so just compile the code
+    return false;
+  }
+  return false;
+}
+
+// lua_Writer that appends to an input_buffer_t, used to dump bytecode for the shared code store
+static int write_buffer(lua_State *L, const void *p, size_t size, void *data) {
+  input_buffer_t *buffer = data;
+  if (buffer->length+size > buffer->size) {
+    size_t newsize = buffer->size? buffer->size: BUFFER_INITIAL_SIZE;
+    while (newsize < buffer->length+size)
+      newsize *= 2;
+    char *newdata = realloc(buffer->data, newsize);
+    if (!newdata)
+      return 1;
+    buffer->data = newdata, buffer->size = newsize;
+  }
+  memcpy(buffer->data+buffer->length, p, size);
+  buffer->length += size;
+  return 0;
+}
+
+// Add the function on top of the Lua stack, compiled from code string `code` of `length` bytes with hash `hash`, to the shared code store
+// Processes that compile the same code at once may both append it; the loser's copy is just unused space
+// The store is optional, so on any failure (e.g. it is full) just don't add it
+static void store_code(lua_State *L, const char *code, size_t length, uint64_t hash) {
+  code_store_t *store = Code_store;
+  input_buffer_t bytecode = {NULL, 0, 0};
+  if (length > UINT32_MAX || lua_dump(L, write_buffer, &bytecode, 0) || bytecode.length > UINT32_MAX) {
+    free(bytecode.data);
+    return;
+  }
+  uint64_t entry_size = (sizeof(code_store_entry_t) + length + bytecode.length + 7) & ~(uint64_t)7;
+  uint64_t offset = atomic_fetch_add(&store->used, entry_size);
+  if (offset+entry_size > store->size) {
+    free(bytecode.data);
+    return;  // store is full
+  }
+  code_store_entry_t *entry = (code_store_entry_t *)((char *)store + offset);
+  entry->hash = hash;
+  entry->code_length = length;
+  entry->bytecode_length = bytecode.length;
+  memcpy(entry->data, code, length);
+  memcpy(entry->data+length, bytecode.data, bytecode.length);
+  free(bytecode.data);
+  // publish the entry in the first free index slot
+  for (int probe=0; probe<CODE_STORE_PROBES; probe++) {
+    uint64_t found = 0;
+    if (atomic_compare_exchange_strong_explicit(&store->index[(hash+probe) & (CODE_STORE_SLOTS-1)], &found, offset,
+        memory_order_release, memory_order_acquire))
+      return;
+    code_store_entry_t *other = stored_entry(store, found);
+    if (other && other->hash == hash && other->code_length == length && !memcmp(other->data, code, length))
+      return;  // another process published it first
+  }
+}
+
 // Initialize State_array if it hasn't already been initialized
 // return 0 on allocation failure
 int init_state_array(void) {
   if (State_array) return !0;
+  open_metrics();
+  open_code_store();
   // initially, allocate space for just the default mlua_state
   State_array = malloc(sizeof(state_array_t) + sizeof(mlua_state_t));
   if (!State_array) return 0;
@@ -141,23 +708,552 @@ int init_sigmask(sigset_t *sigmask, struct sigaction *action) {
 }
 
 
+// Free the code strings held by the cache of compiled code in mlua_state
+// The compiled functions themselves are freed when the lua_State is closed
+static void free_code_cache(mlua_state_t *mlua_state) {
+  for (cache_entry_t *entry=mlua_state->cache; entry < mlua_state->cache+CODE_CACHE_SIZE; entry++) {
+    free(entry->code);
+    entry->code = NULL;
+    entry->hash = 0;
+  }
+}
+
+
+// Free the input buffers of mlua_state created by mlua_append()
+static void free_buffers(mlua_state_t *mlua_state) {
+  for (int i=0; i<mlua_state->buffers_size; i++)
+    free(mlua_state->buffers[i].data);
+  free(mlua_state->buffers);
+  mlua_state->buffers = NULL;
+  mlua_state->buffers_size = 0;
+}
+
+
+// Allocate a new slab for allocator's pools
+// return false if out of memory
+static bool new_slab(allocator_t *allocator) {
+  pool_slab_t *slab = NULL;
+  size_t size = POOL_SLAB_SIZE;
+  bool mapped = false;
+  if (allocator->huge_pages) {
+    // over-allocate so that we can trim the mapping to a huge-page-aligned slab
+    size = HUGE_PAGE_SIZE;
+    char *map = mmap(NULL, size*2, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED) {
+      char *start = (char*)(((uintptr_t)map + size-1) & ~(uintptr_t)(size-1));
+      if (start > map)
+        munmap(map, start-map);
+      munmap(start+size, map+size-start);
+      madvise(start, size, MADV_HUGEPAGE);  // just a hint, so ignore failure
+      slab = (pool_slab_t*)start;
+      mapped = true;
+    }
+  }
+  if (!slab) {
+    size = POOL_SLAB_SIZE;
+    slab = malloc(size);
+    if (!slab)
+      return false;
+  }
+  slab->next = allocator->slabs;
+  slab->size = size;
+  slab->mapped = mapped;
+  allocator->slabs = slab;
+  allocator->slab_bytes += size;
+  allocator->slab_next = (char*)(slab+1);
+  allocator->slab_end = (char*)slab + size;
+  return true;
+}
+
+// Free allocator and all its slabs; must only be called after lua_close() of the lua_State that uses it
+static void free_allocator(allocator_t *allocator) {
+  if (!allocator)
+    return;
+  pool_slab_t *slab, *next;
+  for (slab=allocator->slabs; slab; slab=next) {
+    next = slab->next;
+    if (slab->mapped)
+      munmap(slab, slab->size);
+    else
+      free(slab);
+  }
+  free(allocator);
+}
+
+// Allocate size bytes (size>0) from allocator's pools, or from malloc if they are too large to pool
+static void *allocator_get(allocator_t *allocator, size_t size) {
+  if (!allocator->pooled || size > POOL_CLASSES*POOL_CLASS_SIZE)
+    return malloc(size);
+  int class = (size-1) / POOL_CLASS_SIZE;
+  void *block = allocator->free_lists[class];
+  if (block) {
+    allocator->free_lists[class] = *(void**)block;
+    allocator->blocks_free--;
+  } else {
+    size = (class+1) * POOL_CLASS_SIZE;
+    if (allocator->slab_next + size > allocator->slab_end && !new_slab(allocator))
+      return NULL;
+    block = allocator->slab_next;
+    allocator->slab_next += size;
+  }
+  allocator->blocks_used[class]++;
+  return block;
+}
+
+// Return block of size bytes (size>0) to allocator_get()'s pools, or to malloc if too large to pool
+static void allocator_put(allocator_t *allocator, void *block, size_t size) {
+  if (!allocator->pooled || size > POOL_CLASSES*POOL_CLASS_SIZE) {
+    free(block);
+    return;
+  }
+  int class = (size-1) / POOL_CLASS_SIZE;
+  *(void**)block = allocator->free_lists[class];
+  allocator->free_lists[class] = block;
+  allocator->blocks_used[class]--;
+  allocator->blocks_free++;
+}
+
+// Memory allocation function of type lua_Alloc for lua_States opened by mlua_open()
+// Keeps statistics for mlua_alloc_stats(), enforces allocator->limit within limited_pcall() and, if allocator->pooled, allocates small objects from size-class pools
+static void *mlua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  allocator_t *allocator = ud;
+  if (!ptr)
+    osize = 0;  // Lua passes the type of object being allocated in osize when ptr is NULL
+  if (allocator->limit && allocator->protected_calls && nsize > osize && allocator->in_use + (nsize-osize) > allocator->limit)
+    return NULL;  // Lua raises a memory error, which the protected call catches
+  void *block;
+  if (nsize == 0) {
+    if (ptr)
+      allocator_put(allocator, ptr, osize);
+    block = NULL;
+  } else if (!allocator->pooled)
+    block = realloc(ptr, nsize);
+  else if (ptr && osize > POOL_CLASSES*POOL_CLASS_SIZE && nsize > POOL_CLASSES*POOL_CLASS_SIZE)
+    block = realloc(ptr, nsize);
+  else if (ptr && osize <= POOL_CLASSES*POOL_CLASS_SIZE && nsize <= POOL_CLASSES*POOL_CLASS_SIZE
+           && (osize-1)/POOL_CLASS_SIZE == (nsize-1)/POOL_CLASS_SIZE)
+    block = ptr;  // block is already in the right size class
+  else {
+    block = allocator_get(allocator, nsize);
+    if (block && ptr) {
+      memcpy(block, ptr, osize<nsize? osize: nsize);
+      allocator_put(allocator, ptr, osize);
+    }
+  }
+  if (!block && nsize)
+    return NULL;  // Lua requires the old block to be left untouched when it cannot be resized
+  allocator->in_use += nsize - osize;
+  if (allocator->in_use > allocator->peak)
+    allocator->peak = allocator->in_use;
+  return block;
+}
+
+// Panic function for lua_States created with lua_newstate(), like the one luaL_newstate() installs
+static int mlua_panic(lua_State *L) {
+  const char *msg = lua_tostring(L, -1);
+  fprintf(stderr, "MLua: PANIC: unprotected error in call to Lua API (%s)\n", msg? msg: "error object is not a string");
+  fflush(stderr);
+  return 0;  // return to Lua to abort
+}
+
+// lua_pcall() that enforces the memory limit of `allocator` (if not NULL) during the call
+// The limit is only enforced within protected calls because a memory error raised while MLua pushes parameters or results
+// outside one would be unprotected, making Lua abort the whole process
+static int limited_pcall(lua_State *L, allocator_t *allocator, int args, int results) {
+  if (allocator) allocator->protected_calls++;
+  int error = lua_pcall(L, args, results, 0);
+  if (allocator) allocator->protected_calls--;
+  return error;
+}
+
+// Add the counters in `stats` to `total`
+static void add_stats(call_stats_t *total, const call_stats_t *stats) {
+  total->calls += stats->calls;
+  total->errors += stats->errors;
+  total->compiles += stats->compiles;
+  total->compile_ns += stats->compile_ns;
+  total->run_ns += stats->run_ns;
+  total->signal_ns += stats->signal_ns;
+  total->bytes_in += stats->bytes_in;
+  total->bytes_out += stats->bytes_out;
+  total->truncations += stats->truncations;
+}
+
+// Key in the baseline snapshot table under which the metatable of the globals table is stored
+#define BASELINE_METATABLE "globals metatable"
+
+// Record in baseline table (at index `baseline`) a shallow copy of the table at `index`, indexed by that table
+static void snapshot_table(lua_State *L, int baseline, int index) {
+  index = lua_absindex(L, index);
+  lua_pushvalue(L, index);
+  lua_rawget(L, baseline);
+  bool recorded = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (recorded)
+    return;
+  lua_pushvalue(L, index);
+  lua_newtable(L);
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, -4);  // copy[key] = value
+  }
+  lua_rawset(L, baseline);  // baseline[table] = copy
+}
+
+// Record snapshots of the table at `index` and of every table it contains
+static void snapshot_tables(lua_State *L, int baseline, int index) {
+  index = lua_absindex(L, index);
+  snapshot_table(L, baseline, index);
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    if (lua_type(L, -1) == LUA_TTABLE)
+      snapshot_table(L, baseline, -1);
+    lua_pop(L, 1);
+  }
+}
+
+// Return a snapshot of the globals and loaded modules, from which mlua_reset() can restore them, for lua_States opened with MLUA_RESETTABLE
+// The snapshot is a table whose keys are the globals table, package.loaded and the tables they contain (e.g. libraries and modules),
+// and whose values are shallow copies of those tables
+// Lua C function so that it can be called with protected pcall
+static int record_baseline(lua_State *L) {
+  lua_newtable(L);
+  int baseline = lua_gettop(L);
+  lua_pushglobaltable(L);
+  snapshot_tables(L, baseline, -1);
+  if (!lua_getmetatable(L, -1))
+    lua_pushnil(L);
+  lua_setfield(L, baseline, BASELINE_METATABLE);
+  lua_pop(L, 1);  // pop globals
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");  // package.loaded
+  if (lua_type(L, -1) == LUA_TTABLE)
+    snapshot_tables(L, baseline, -1);
+  lua_pop(L, 1);
+  return 1;  // return baseline
+}
+
+// Restore the table at index `table` to the contents of its snapshot `copy`
+static void restore_table(lua_State *L, int table, int copy) {
+  table = lua_absindex(L, table);
+  copy = lua_absindex(L, copy);
+  // first remove keys added since the snapshot -- Lua allows clearing fields during traversal
+  lua_pushnil(L);
+  while (lua_next(L, table)) {
+    lua_pop(L, 1);  // pop value
+    lua_pushvalue(L, -1);
+    lua_rawget(L, copy);
+    if (lua_isnil(L, -1)) {
+      lua_pushvalue(L, -2);
+      lua_pushnil(L);
+      lua_rawset(L, table);
+    }
+    lua_pop(L, 1);
+  }
+  // then restore the recorded keys
+  lua_pushnil(L);
+  while (lua_next(L, copy)) {
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, table);
+  }
+}
+
+// Restore the globals and loaded modules from the snapshot passed as the first parameter (recorded by record_baseline())
+// Lua C function so that it can be called with protected pcall
+static int restore_baseline(lua_State *L) {
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    if (lua_type(L, -2) == LUA_TTABLE)
+      restore_table(L, -2, -1);
+    lua_pop(L, 1);
+  }
+  lua_pushglobaltable(L);
+  lua_getfield(L, 1, BASELINE_METATABLE);
+  lua_setmetatable(L, -2);
+  return 0;
+}
+
+// Return 64-bit FNV-1a hash of a code string, never returning 0 which marks an unused cache entry
+static uint64_t hash_code(const char *code, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const unsigned char *p = (const unsigned char *)code;
+  while (length--)
+    hash = (hash ^ *p++) * 0x100000001b3ULL;
+  return hash? hash: 1;
+}
+
+// On-disk cache of compiled Lua bytecode for MLUA_INIT and for modules loaded by require()
+// It is used if environment variable MLUA_BYTECODE_CACHE names a directory that belongs to the user and that no one else can write to;
+// cache files are likewise only loaded if they belong to the user and no one else can write to them
+// If MLUA_BYTECODE_STRIP is also set non-empty, cached bytecode omits debug info (Lua 5.3+ only): faster to load, but errors lose line numbers
+
+#define BYTECODE_MAGIC "MLuaBC1\n"
+
+// Header of a bytecode cache file, followed by the source identity string then the bytecode
+// A cache file is used only if its whole header and source identity match those of the source being loaded
+typedef struct bytecode_header_t {
+  char magic[8];  // BYTECODE_MAGIC
+  char release[32];  // BYTECODE_RELEASE of the Lua that compiled it
+  uint64_t size;  // size of the source
+  int64_t mtime_sec, mtime_nsec;  // modification time of the source file, or 0 for a code string
+  uint32_t strip;  // whether debug info was stripped
+  uint32_t source_length;  // length of the source identity that follows: the file's real path, or the code string itself
+} bytecode_header_t;
+
+// State of read_bytecode()
+typedef struct bytecode_reader_t {
+  FILE *file;
+  char buffer[BUFSIZ];
+} bytecode_reader_t;
+
+// lua_Reader to load bytecode from a cache file
+static const char *read_bytecode(lua_State *L, void *data, size_t *size) {
+  bytecode_reader_t *reader = data;
+  *size = fread(reader->buffer, 1, sizeof(reader->buffer), reader->file);
+  return *size? reader->buffer: NULL;
+}
+
+// lua_Writer to save bytecode to a cache file
+static int write_bytecode(lua_State *L, const void *p, size_t size, void *file) {
+  return fwrite(p, 1, size, file) != size;
+}
+
+// Compile Lua file `filename`, or if filename is NULL, compile code string `code` of `length` bytes
+// Load it from the bytecode cache if MLUA_BYTECODE_CACHE is set and the cache has it; otherwise compile and save it to the cache
+// Return the same status and stack result as luaL_loadfile(); any failure to use the cache just falls back to compiling
+static int load_cached(lua_State *L, const char *filename, const char *code, size_t length) {
+  const char *dir = getenv("MLUA_BYTECODE_CACHE");
+  const char *strip = getenv("MLUA_BYTECODE_STRIP");
+  struct stat st, dir_st;
+  if (!dir || !*dir || stat(dir, &dir_st) || !S_ISDIR(dir_st.st_mode) || !private_to_user(&dir_st) || (filename && stat(filename, &st)))
+    return filename? luaL_loadfile(L, filename): luaL_loadbuffer(L, code, length, code);
+  bytecode_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  strncpy(header.release, BYTECODE_RELEASE, sizeof(header.release)-1);
+#if LUA_VERSION_NUM >= 503
+  header.strip = strip && *strip;
+#else
+  header.strip = 0;  // lua_dump() before Lua 5.3 cannot strip debug info, so record that it was kept
+  (void)strip;
+#endif
+  char *realname = NULL;
+  if (filename) {
+    realname = realpath(filename, NULL);
+    if (!realname)
+      return luaL_loadfile(L, filename);
+    code = realname, length = strlen(realname);
+    header.size = st.st_size;
+    header.mtime_sec = st.st_mtim.tv_sec, header.mtime_nsec = st.st_mtim.tv_nsec;
+  } else
+    header.size = length;
+  header.source_length = length;
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hash_code(code, length));
+  lua_pushfstring(L, "%s/%s.luac", dir, hash);
+  const char *path = lua_tostring(L, -1);
+
+  // load from cache if present and valid
+  int error = 1;
+  FILE *file = NULL;
+  int fd = open(path, O_RDONLY|O_NOFOLLOW);
+  if (fd >= 0) {
+    struct stat file_st;
+    if (!fstat(fd, &file_st) && S_ISREG(file_st.st_mode) && private_to_user(&file_st))
+      file = fdopen(fd, "rb");
+    if (!file)
+      close(fd);
+  }
+  if (file) {
+    bytecode_header_t cached;
+    bool valid = fread(&cached, sizeof(cached), 1, file) == 1 && !memcmp(&cached, &header, sizeof(header));
+    for (size_t i=0; valid && i<length; i++)
+      valid = getc(file) == (unsigned char)code[i];
+    if (valid) {
+      bytecode_reader_t *reader = malloc(sizeof(bytecode_reader_t));
+      if (reader) {
+        reader->file = file;
+        const char *chunkname = filename? lua_pushfstring(L, "@%s", filename): code;
+        error = lua_load(L, read_bytecode, reader, chunkname, "b");
+        if (filename) lua_remove(L, -2);  // chunkname
+        if (error) lua_pop(L, 1);  // incompatible bytecode: recompile it
+        else Bytecode_hits++;
+        free(reader);
+      }
+    }
+    fclose(file);
+  }
+  // otherwise compile and save to cache, writing to a temporary file first so that no other process can read a partial file
+  // mkstemp() creates it with an unpredictable name and mode 0600, so others can neither plant nor redirect it with a symlink
+  if (error) {
+    error = filename? luaL_loadfile(L, filename): luaL_loadbuffer(L, code, length, code);
+    char *tmppath = error? NULL: malloc(strlen(path)+sizeof(".XXXXXX"));
+    if (tmppath) {
+      sprintf(tmppath, "%s.XXXXXX", path);
+      fd = mkstemp(tmppath);
+      file = fd < 0? NULL: fdopen(fd, "wb");
+      if (fd >= 0 && !file) {
+        close(fd);
+        unlink(tmppath);
+      }
+      if (file) {
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(code, 1, length, file) == length
+          && !lua_dump(L, write_bytecode, file, header.strip);  // dump the function on top of the stack
+        if (fclose(file) || !written || rename(tmppath, path))
+          unlink(tmppath);
+      }
+      free(tmppath);
+    }
+  }
+  lua_remove(L, -2);  // path
+  free(realname);
+  return error;
+}
+
+// Searcher for require() that replaces package's Lua file searcher to load modules through the bytecode cache
+// It searches package.path just as the standard searcher does (package.searchpath is not available in Lua 5.1)
+// Its upvalue is the package table
+static int search_cached(lua_State *L) {
+  const char *name = luaL_gsub(L, luaL_checkstring(L, 1), ".", "/");
+  lua_getfield(L, lua_upvalueindex(1), "path");
+  const char *path = lua_tostring(L, -1);
+  if (!path)
+    luaL_error(L, "'package.path' must be a string");
+  int messages = 0;
+  for (const char *template=path, *end; *template; template=*end? end+1: end) {
+    end = strchr(template, ';');
+    if (!end) end = template+strlen(template);
+    if (end == template) continue;
+    lua_pushlstring(L, template, end-template);
+    const char *filename = luaL_gsub(L, lua_tostring(L, -1), "?", name);
+    lua_remove(L, -2);  // template
+    FILE *file = fopen(filename, "r");
+    if (file) {
+      fclose(file);
+      if (load_cached(L, filename, NULL, 0))
+        luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", lua_tostring(L, 1), filename, lua_tostring(L, -1));
+      lua_pushstring(L, filename);
+      return 2;  // loader function and the file name that Lua 5.2+ passes to it
+    }
+    lua_pushfstring(L, "\n\tno file '%s'", filename);
+    lua_remove(L, -2);  // filename
+    messages++;
+  }
+  lua_concat(L, messages);
+  return 1;
+}
+
+// Make require() load Lua modules through the bytecode cache by replacing package's Lua file searcher with search_cached()
+// Lua C function so that it can be called with protected pcall
+static int install_cached_searcher(lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, LUA_LOADLIBNAME);
+  lua_getfield(L, -1, "searchers");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "loaders");  // Lua 5.1 name for searchers
+  }
+  if (!lua_istable(L, -1))
+    return 0;
+  lua_pushvalue(L, -2);
+  lua_pushcclosure(L, search_cached, 1);
+  lua_rawseti(L, -2, 2);  // the standard Lua file searcher is second, after the preload searcher
+  return 0;
+}
+
+// define the buffer of database updates made by Lua functions mlua.set() and mlua.kill() of the 'mlua' Lua module
+// They are applied to YDB together in one transaction when the outermost call into Lua ends, or when Lua calls mlua.flush()
+typedef struct updates_t {
+  input_buffer_t buffer;  // records of each update: 'S' or 'K', variable name, subscript count, subscripts and (for 'S') value
+  input_buffer_t record;  // the update being encoded, which is only appended to buffer once complete
+  size_t count;  // number of updates in buffer
+  int depth;  // number of calls into Lua in progress: only the outermost one flushes updates as it ends
+  uint64_t emptied;  // number of times the buffer has been flushed or discarded, to tell whether an updates_mark_t still holds
+  // statistics returned by mlua.flushstats(): totals, and the updates applied, restarts and time of the last flush
+  uint64_t flushes, updates, restarts, errors, flush_ns;
+  uint64_t last_updates, last_restarts, last_flush_ns;
+} updates_t;
+
+static updates_t Updates;
+static int end_updates(lua_State *L, int error, int base);  // defined at the end of this file with the 'mlua' Lua module
+
+// Position in the update buffer when a call into Lua starts, so that a nested call that fails can discard just its own updates
+typedef struct updates_mark_t {
+  size_t length, count;
+  uint64_t emptied;  // Updates.emptied at the time: if the buffer has been emptied since, all it holds was buffered by the call
+} updates_mark_t;
+
+// Start a call into Lua that may buffer updates, returning the mark to pass to end_call_updates()
+static updates_mark_t begin_call_updates(void) {
+  Updates.depth++;
+  return (updates_mark_t){Updates.buffer.length, Updates.count, Updates.emptied};
+}
+
+// End a call into Lua that began with begin_call_updates() and that failed if `failed` is true
+// A nested call that failed discards the updates it buffered, leaving those of its callers for the outermost call to flush
+// return true if this was the outermost call, which must then end_updates() if any are buffered
+static bool end_call_updates(updates_mark_t mark, bool failed) {
+  if (--Updates.depth == 0)
+    return true;
+  if (failed) {
+    bool kept = Updates.emptied == mark.emptied;
+    Updates.buffer.length = kept? mark.length: 0;
+    Updates.count = kept? mark.count: 0;
+  }
+  return false;
+}
+
+static int luaopen_mlua(lua_State *L);  // defined at the end of this file along with the rest of the 'mlua' Lua module
+
+// Preload the Lua module 'mlua' so that Lua code can require'mlua'
+// Lua C function so that it can be called with protected pcall
+static int preload_mlua(lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, LUA_LOADLIBNAME);
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, luaopen_mlua);
+  lua_setfield(L, -2, "mlua");
+  return 0;
+}
+
 // Create new Lua_State, and initialize with default lua libs
 //    and run the text in environment variable MLUA_INIT (or run the file if it starts with @)
+//    if environment variable MLUA_BYTECODE_CACHE names a directory, MLUA_INIT and modules loaded by require() are compiled
+//    only once and their bytecode cached there (see load_cached())
 // Flags is an optional bitfield, whose bitmasks are defined in mlua.h as follows:
 //    MLUA_IGNORE_INIT: ignore MLUA_INIT
 //    MLUA_ΒLOCK_SIGNALS: Prevent signals from interrupting Lua (causing EINTR errors during 'slow' I/O)
 //    see README for performance overhead of this
+//    MLUA_BLOCK_IO_SIGNALS: Like MLUA_BLOCK_SIGNALS but block signals only while Lua's io/os library functions run,
+//    so that calls which do no IO incur no signal-blocking overhead
+//    MLUA_STREAM_RESULTS: Return a result id from mlua_lua() for results too long to fit the output string (see mlua_fetch())
+//    MLUA_POOL_ALLOC: Allocate Lua's small objects from per-lua_State pools instead of directly from malloc
+//    MLUA_HUGE_PAGES: Back the pools of MLUA_POOL_ALLOC with transparent huge pages (implies MLUA_POOL_ALLOC)
+//    MLUA_TIME_CALLS: Measure compile, run and signal-blocking times for mlua_stats()
+//    MLUA_RESETTABLE: Record a snapshot of the globals after init so that mlua_reset() can restore them
+//    MLUA_LAZY_LIBS: Open standard libraries not listed in `libs` on first use rather than not at all
+// Memory_limit is an optional maximum number of bytes the lua_State may allocate (0 or missing for no limit)
+//    Lua code that exceeds it gets a Lua "not enough memory" error which mlua_lua() returns as usual
+//    the limit applies while Lua code runs (see limited_pcall()) but not while MLua passes it parameters or fetches results
+// Libs is an optional comma-separated list of the standard libraries to open, e.g. "string,table" (missing for all)
+//    the base and package libraries are always opened; this makes opening faster and smaller when few libraries are needed
 // return new lua_State handle or zero if there is an error, with error message as follows:
 //    optional output returns empty on success or an error message on error (or on stdout if output missing)
 // Note: if internal-use MLUA_OPEN_DEFAULT flag is supplied, always return -1 on success or zero on error
-gtm_long_t mlua_open(int argc, gtm_string_t *output, gtm_int_t flags) {
+gtm_long_t mlua_open(int argc, gtm_string_t *output, gtm_int_t flags, gtm_long_t memory_limit, const gtm_string_t *libs) {
   lua_State *L;
   if (argc<1) output=NULL; // don't return error string
   if (argc<2) flags=0;
+  if (argc<3) memory_limit=0;
+  if (argc<4) libs=NULL;
   int output_size = output? output->length: 0; // ydb sets it to preallocated size
 
   if (!init_state_array())
     return outputf(output, output_size, "MLua: Could not allocate memory for lua_State"), 0;
+  if (memory_limit < 0)
+    return outputf(output, output_size, "MLua: memory limit (%li) must not be negative", memory_limit), 0;
   sigset_t sigmask;
   struct sigaction sigalrm_action;
   if (!init_sigmask(&sigmask, &sigalrm_action))
@@ -176,43 +1272,136 @@ gtm_long_t mlua_open(int argc, gtm_string_t *output, gtm_int_t flags) {
     }
     handle = State_array->used;
   }
-  L = luaL_newstate();
+  allocator_t *allocator = calloc(1, sizeof(allocator_t));
+  if (!allocator)
+    return outputf(output, output_size, "MLua: Could not allocate memory for lua_State"), 0;
+  allocator->pooled = flags & (MLUA_POOL_ALLOC|MLUA_HUGE_PAGES);
+  allocator->huge_pages = flags & MLUA_HUGE_PAGES;
+  allocator->limit = memory_limit;
+  L = lua_newstate(mlua_alloc, allocator);
+  if (L)
+    lua_atpanic(L, mlua_panic);
+  else {
+    // some Lua implementations (e.g. LuaJIT on some 64-bit platforms) refuse custom allocators, so fall back to the default one
+    free_allocator(allocator);
+    allocator = NULL;
+    if (memory_limit)
+      return outputf(output, output_size, "MLua: Could not allocate lua_State within memory limit, or this Lua implementation does not support memory limits"), 0;
+    L = luaL_newstate();
+  }
   if (!L)
     return outputf(output, output_size, "MLua: Could not allocate memory for lua_State"), 0;
-  // After this point any error return must call lua_close(L)
+  // After this point any error return must call lua_close(L) and free_allocator(allocator)
 
+  memset(&State_array->states[handle], 0, sizeof(mlua_state_t));
+  State_array->states[handle].allocator = allocator;
   State_array->states[handle].flags = flags;
   State_array->states[handle].sigmask = sigmask;
   State_array->states[handle].sigalrm_action = sigalrm_action;
 
-  // Open default lua libs and add them to the new lua_State
-  lua_pushcfunction(L, luaL_openlibs_ret0);
-  int args=0, results=0, error_handler=0;
-  int error = lua_pcall(L, args, results, error_handler);
+  // Open default lua libs (or the selected ones) and add them to the new lua_State
+  int args=0, results=0;
+  if (libs || flags & MLUA_LAZY_LIBS) {
+    lua_pushcfunction(L, open_selected_libs);
+    if (libs)
+      lua_pushlstring(L, libs->address, libs->length);
+    else
+      lua_pushliteral(L, "");
+    // MLUA_BLOCK_IO_SIGNALS wraps the io and os libraries when opened, so they cannot be lazy
+    if (flags & MLUA_BLOCK_IO_SIGNALS)
+      lua_pushfstring(L, "%s,%s,%s", lua_tostring(L, -1), LUA_IOLIBNAME, LUA_OSLIBNAME), lua_remove(L, -2);
+    lua_pushboolean(L, flags & MLUA_LAZY_LIBS);
+    args = 2;
+  } else
+    lua_pushcfunction(L, luaL_openlibs_ret0);
+  int error = limited_pcall(L, allocator, args, results);
+  args = 0;
   if (error) {
     outputf(output, output_size, "Lua: in init luaL_openlibs(), %s", lua_tostring(L, -1));
     lua_pop(L, 1);  // pop error message from the stack
     lua_close(L);  // We haven't successfully opened it fully, so close it
+    free_allocator(allocator);
+    return 0;
+  }
+
+  lua_pushcfunction(L, preload_mlua);
+  error = limited_pcall(L, allocator, args, results);
+  if (error) {
+    outputf(output, output_size, "MLua: in init preloading module mlua, %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    lua_close(L);  // We haven't successfully opened it fully, so close it
+    free_allocator(allocator);
     return 0;
   }
 
+  // make IO functions block signals, if requested
+  if (flags & MLUA_BLOCK_IO_SIGNALS) {
+    IO_sigmask = sigmask;
+    IO_sigalrm_action = sigalrm_action;
+    IO_sigalrm_action.sa_flags &= ~SA_RESTART;
+    lua_pushcfunction(L, wrap_io_libs);
+    error = limited_pcall(L, allocator, args, results);
+    if (error) {
+      outputf(output, output_size, "MLua: in init wrapping IO functions, %s", lua_tostring(L, -1));
+      lua_pop(L, 1);  // pop error message from the stack
+      lua_close(L);  // We haven't successfully opened it fully, so close it
+      free_allocator(allocator);
+      return 0;
+    }
+  }
+
+  // make require() use the bytecode cache
+  char *bytecode_cache = getenv("MLUA_BYTECODE_CACHE");
+  if (bytecode_cache && *bytecode_cache) {
+    lua_pushcfunction(L, install_cached_searcher);
+    error = limited_pcall(L, allocator, args, results);
+    if (error) {
+      outputf(output, output_size, "MLua: in init installing bytecode cache, %s", lua_tostring(L, -1));
+      lua_pop(L, 1);  // pop error message from the stack
+      lua_close(L);  // We haven't successfully opened it fully, so close it
+      free_allocator(allocator);
+      return 0;
+    }
+  }
+
   // execute code in the environment variable MLUA_INIT (or in the file it specifies with @file)
   char *mlua_init=NULL;
   if (!(flags&MLUA_IGNORE_INIT))
     mlua_init = getenv("MLUA_INIT");
   if (mlua_init) {
     if (mlua_init[0] == '@')
-      error = luaL_loadfile(L, mlua_init+1);
+      error = load_cached(L, mlua_init+1, NULL, 0);
     else
-      error = luaL_loadbuffer(L, mlua_init, strlen(mlua_init), mlua_init);
-    if (!error)
-      error = lua_pcall(L, args, results, error_handler);
+      error = load_cached(L, NULL, mlua_init, strlen(mlua_init));
+    if (!error) {
+      // flush or discard the updates that the init code buffers, rather than leave them to whatever call runs next
+      int base = lua_gettop(L) - 1;
+      updates_mark_t mark = begin_call_updates();
+      error = limited_pcall(L, allocator, args, results);
+      if (end_call_updates(mark, error) && Updates.count)
+        error = end_updates(L, error, base);
+    }
     if (error) {
       outputf(output, output_size, "MLua: MLUA_INIT, %s", lua_tostring(L, -1));
       lua_pop(L, 1);  // pop error message from the stack
       lua_close(L);   // We haven't successfully opened it fully, so close it
+      free_allocator(allocator);
+      return 0;
+    }
+  }
+
+  // record the post-init state for mlua_reset()
+  if (flags & MLUA_RESETTABLE) {
+    lua_pushcfunction(L, record_baseline);
+    error = limited_pcall(L, allocator, 0, 1);
+    if (error) {
+      outputf(output, output_size, "MLua: in init recording baseline for reset, %s", lua_tostring(L, -1));
+      lua_pop(L, 1);  // pop error message from the stack
+      lua_close(L);  // We haven't successfully opened it fully, so close it
+      free_allocator(allocator);
       return 0;
     }
+    State_array->states[handle].baseline_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
 
   // clear error string & return handle
@@ -251,7 +1440,13 @@ gtm_int_t mlua_close(int argc, gtm_long_t luaState_handle) {
   L = State_array->states[luaState_handle].luastate;
   if (!L)
     return -2;
+  add_stats(&Closed_stats, &State_array->states[luaState_handle].stats);
+  free_code_cache(&State_array->states[luaState_handle]);
+  free(State_array->states[luaState_handle].results);
+  free_buffers(&State_array->states[luaState_handle]);
   lua_close(L);
+  free_allocator(State_array->states[luaState_handle].allocator);
+  State_array->states[luaState_handle].allocator = NULL;
   State_array->states[luaState_handle].luastate = NULL; // ensure we don't close it twice
 
   // Mark any empy handles at the end of the array as unused.
@@ -263,15 +1458,68 @@ gtm_int_t mlua_close(int argc, gtm_long_t luaState_handle) {
 }
 
 
+// push_code() helper to compile a code string, first looking for it in mlua_state's cache of compiled code
+// and then in the shared code store, if in use
+// return 0 and the compiled function on top of the Lua stack
+// on error, return nonzero with the error message string on the top of the Lua stack
+static int load_code(mlua_state_t *mlua_state, const gtm_string_t *code_string) {
+  lua_State *L = mlua_state->luastate;
+  size_t length = code_string->length;
+  uint64_t hash = hash_code(code_string->address, length);
+  cache_entry_t *entry, *victim = mlua_state->cache;
+  mlua_state->cache_clock++;
+  for (entry=mlua_state->cache; entry < mlua_state->cache+CODE_CACHE_SIZE; entry++) {
+    if (entry->hash == hash && entry->length == length && !memcmp(entry->code, code_string->address, length)) {
+      entry->last_used = mlua_state->cache_clock;
+      mlua_state->cache_hits++;
+      lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+      return 0;
+    }
+    if (entry->last_used < victim->last_used)
+      victim = entry;  // unused entries have last_used=0 so they are chosen first
+  }
+  mlua_state->cache_misses++;
+  // the shared code store may have bytecode compiled by another process
+  if (!Code_store || !load_stored_code(L, code_string->address, length, hash)) {
+    mlua_state->stats.compiles++;
+    gtm_long_t start = mlua_state->flags & MLUA_TIME_CALLS? mlua_nanoseconds(0, 0): 0;
+    int error = luaL_loadbuffer(L, code_string->address, length, "mlua(code)");
+    if (start)
+      mlua_state->stats.compile_ns += mlua_nanoseconds(0, 0) - start;
+    if (error)
+      return error;
+    if (Code_store)
+      store_code(L, code_string->address, length, hash);
+  }
+
+  // store compiled function in the least recently used cache entry
+  char *code = malloc(length+1);  // +1 so that malloc never has to allocate zero bytes
+  if (!code)
+    return 0;  // just don't cache it
+  memcpy(code, code_string->address, length);
+  if (victim->hash) {
+    free(victim->code);
+    luaL_unref(L, LUA_REGISTRYINDEX, victim->ref);
+  }
+  lua_pushvalue(L, -1);
+  victim->ref = luaL_ref(L, LUA_REGISTRYINDEX);  // pops the copy of the function
+  victim->code = code;
+  victim->length = length;
+  victim->hash = hash;
+  victim->last_used = mlua_state->cache_clock;
+  return 0;
+}
+
 // mlua_lua() helper to translate code string into a function
 // push function if it's a global function name (starting with '>'); allows '.' notation like, "math.abs"
-// otherwise compile the code into a function and push that
+// otherwise compile the code into a function and push that (or fetch it from the cache if it was compiled before)
 // return 0 and the compiled function on top of the Lua stack
 // on error, return 1 with the error message string on the top of the Lua stack
-static int push_code(lua_State *L, const gtm_string_t *code_string) {
+static int push_code(mlua_state_t *mlua_state, const gtm_string_t *code_string) {
+  lua_State *L = mlua_state->luastate;
   // compile the code and push it
   if (!code_string->length || code_string->address[0] != '>')
-    return luaL_loadbuffer(L, code_string->address, code_string->length, "mlua(code)");
+    return load_code(mlua_state, code_string);
 
   // otherwise look up function name in global (e.g. module) table and push it instead
   lua_pushglobaltable(L);
@@ -308,11 +1556,53 @@ static int push_code(lua_State *L, const gtm_string_t *code_string) {
   return 0;
 }
 
+// format_result() helper to pin the Lua string on top of the stack in the registry so that its remaining data
+// (after the first `offset` bytes) can be streamed to M by mlua_fetch() without copying it
+// return the new result id >0, or 0 if there was no memory to track it
+static gtm_int_t pin_result(lua_State *L, mlua_state_t *mlua_state, const char *data, size_t length, size_t offset) {
+  int id;
+  for (id=1; id<=mlua_state->results_size && mlua_state->results[id-1].data; id++);
+  if (id > mlua_state->results_size) {
+    pinned_result_t *results = realloc(mlua_state->results, (mlua_state->results_size+RESULT_ARRAY_LUMPS) * sizeof(pinned_result_t));
+    if (!results)
+      return 0;
+    memset(results+mlua_state->results_size, 0, RESULT_ARRAY_LUMPS * sizeof(pinned_result_t));
+    mlua_state->results = results;
+    mlua_state->results_size += RESULT_ARRAY_LUMPS;
+  }
+  // create registry table of pinned results if it doesn't yet exist
+  if (!mlua_state->results_ref) {
+    lua_newtable(L);
+    mlua_state->results_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->results_ref);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, id);  // results_table[id] = string
+  lua_pop(L, 1);  // pop results table
+  pinned_result_t *result = &mlua_state->results[id-1];
+  result->data = data;
+  result->length = length;
+  result->offset = offset;
+  return id;
+}
+
+// Unpin result id so that the Lua string may be garbage collected
+static void release_result(lua_State *L, mlua_state_t *mlua_state, int id) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->results_ref);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, id);
+  lua_pop(L, 1);  // pop results table
+  mlua_state->results[id-1].data = NULL;
+}
+
 // mlua_lua() helper to format result output data type for more natural interpretation by M
 // the data type is passed in on the top of the Lua stack and is popped off before return
-static void format_result(lua_State *L, gtm_string_t *output, int output_size) {
+// return 0, or if the result string is longer than output_size and luaState_handle was opened with MLUA_STREAM_RESULTS,
+// return a result id >0 from which mlua_fetch() can fetch the remainder of the string
+static gtm_int_t format_result(lua_State *L, gtm_long_t luaState_handle, gtm_string_t *output, int output_size) {
   size_t len;
   const char *s;
+  gtm_int_t id = 0;
   if (output && !output->address) output=NULL;
   int output_type = lua_type(L, -1);
   switch (output_type) {
@@ -348,12 +1638,19 @@ static void format_result(lua_State *L, gtm_string_t *output, int output_size) {
         }
         fwrite(s, 1, len, DEFAULT_OUTPUT);
         fflush(DEFAULT_OUTPUT);
+        State_array->states[luaState_handle].stats.bytes_out += len;
         goto done;
       }
-      if (len > output_size)
+      if (len > output_size) {
+        if (output_type == LUA_TSTRING && State_array->states[luaState_handle].flags & MLUA_STREAM_RESULTS)
+          id = pin_result(L, &State_array->states[luaState_handle], s, len, output_size);
+        if (!id)
+          State_array->states[luaState_handle].stats.truncations++;
         len = output_size;
+      }
       memcpy(output->address, s, len);
       output->length = len;
+      State_array->states[luaState_handle].stats.bytes_out += len;
       if (output_type == LUA_TNUMBER) {
         // convert any exponential notation 'e' in a number to 'E' so YDB can understand it.
         char *e_position = memchr(output->address, 'e', len);
@@ -365,74 +1662,2671 @@ static void format_result(lua_State *L, gtm_string_t *output, int output_size) {
   }
 done:
   lua_pop(L, 1);  // pop result from the Lua stack
+  return id;
 }
 
-// Run Lua code
-// If luaState_handle is 0 or not supplied, use the default lua_State (opening it if needed)
-// return 0 on success and return a string representation of the return value in .output (if supplied) or on stdout
-// return <0 on error and return the error message in .output (if supplied) or on stdout
-gtm_int_t mlua_lua(int argc, const gtm_string_t *code, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
-  if (argc<1) return MLUA_ERROR;  // no code to run so return error status -- but can't return output string (not supplied)
-  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
-  int output_size = output? output->length: 0; // ydb sets it to preallocated size
-
+// mlua_lua() helper to fetch the lua_State for luaState_handle, opening the default lua_State (handle 0) if needed
+// return the lua_State, or NULL on error with the error message in output
+static lua_State *get_luastate(gtm_long_t luaState_handle, gtm_string_t *output, int output_size) {
   // check that luaState is valid
   if (!init_state_array())
-    return outputf(output, output_size, "MLua: could not allocate space for luaState array"), MLUA_ERROR;
-  if (argc<3) luaState_handle=0; // use default lua_State
+    return outputf(output, output_size, "MLua: could not allocate space for luaState array"), NULL;
   if (luaState_handle) {
     if (luaState_handle<0 || luaState_handle>=State_array->used)
-      return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+      return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), NULL;
     if (!State_array->states[luaState_handle].luastate)
-      return outputf(output, output_size, "MLua: supplied luaState (%li) has been closed", luaState_handle), MLUA_ERROR;
+      return outputf(output, output_size, "MLua: supplied luaState (%li) has been closed", luaState_handle), NULL;
   }
-  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
-  lua_State *L = mlua_state->luastate;
+  lua_State *L = State_array->states[luaState_handle].luastate;
 
   // open default lua state if necessary
   if (!L) {
     // luaState_handle already equals 0 (default) in this case, but we haven't yet opened the default state
-    if (!mlua_open(2, output, MLUA_OPEN_DEFAULT))
-      return MLUA_ERROR;  // could not open; note: output already filled by opener
-    mlua_state = &State_array->states[0];  // recalculate mlua_state because mlua_open may have realloc()'ed it
-    L = mlua_state->luastate;
+    if (!mlua_open(2, output, MLUA_OPEN_DEFAULT, 0, NULL))
+      return NULL;  // could not open; note: output already filled by opener
+    L = State_array->states[0].luastate;
   }
+  return L;
+}
 
-  // push function if it's a function name; otherwise compile the code
-  int error = push_code(L, code);
-  if (!error) {
-    // push any optional parameters as function parameters to Lua
-    int args = argc-3<0? 0: argc-3;
-    if (args) {
-      va_list ptr;
-      va_start(ptr, luaState_handle);
-      for (int i=0; i<args; i++) {
-        gtm_string_t *s = va_arg(ptr, gtm_string_t*);
-        lua_pushlstring(L, s->address, s->length);
-      }
-      va_end(ptr);
-    }
-    int results=1, error_handler=0;
-    if (mlua_state->flags & MLUA_BLOCK_SIGNALS) {
-      sigset_t oldmask;
-      // two sigprocmask calls (set+unset) take 873 instructions (3018 cycles, 609ns on my i7) - tested with perf
-      // two sigaction calls (set+unset) take 925 instructions (3000 cycles, 685ns on my i7) - tested with perf
-      SIGPROCMASK(SIG_BLOCK, &mlua_state->sigmask, &oldmask);
-      mlua_state->sigalrm_action.sa_flags |= SA_RESTART;
-      sigaction(SIGALRM, &mlua_state->sigalrm_action, NULL);
-      error = lua_pcall(L, args, results, error_handler);
-      mlua_state->sigalrm_action.sa_flags &= ~SA_RESTART;
-      sigaction(SIGALRM, &mlua_state->sigalrm_action, NULL);
-      SIGPROCMASK(SIG_SETMASK, &oldmask, NULL);
-    } else
-      error = lua_pcall(L, args, results, error_handler);
+// Block the YDB signals that would otherwise interrupt Lua's slow IO, if luaState_handle was opened with MLUA_BLOCK_SIGNALS
+// the previous signal mask is stored in oldmask for restoring by unblock_signals()
+static void block_signals(gtm_long_t luaState_handle, sigset_t *oldmask) {
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (!(mlua_state->flags & MLUA_BLOCK_SIGNALS))
+    return;
+  // two sigprocmask calls (set+unset) take 873 instructions (3018 cycles, 609ns on my i7) - tested with perf
+  // two sigaction calls (set+unset) take 925 instructions (3000 cycles, 685ns on my i7) - tested with perf
+  SIGPROCMASK(SIG_BLOCK, &mlua_state->sigmask, oldmask);
+  mlua_state->sigalrm_action.sa_flags |= SA_RESTART;
+  sigaction(SIGALRM, &mlua_state->sigalrm_action, NULL);
+}
+
+// Restore signals blocked by block_signals()
+// Note: Lua code may call M which may open new lua_States, realloc'ing State_array, so we look up the state afresh here
+static void unblock_signals(gtm_long_t luaState_handle, sigset_t *oldmask) {
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (!(mlua_state->flags & MLUA_BLOCK_SIGNALS))
+    return;
+  mlua_state->sigalrm_action.sa_flags &= ~SA_RESTART;
+  sigaction(SIGALRM, &mlua_state->sigalrm_action, NULL);
+  SIGPROCMASK(SIG_SETMASK, oldmask, NULL);
+}
 
+// Registry key of the profile_t userdata of a lua_State that is being profiled
+static char Profile_key;
+
+// Add one sample of the current Lua call stack to profile in folded-stack format: "outer;...;inner" frames
+static void sample_stack(lua_State *L, profile_t *profile) {
+  lua_Debug ar;
+  int depth = 0;
+  while (depth < PROFILE_MAX_DEPTH && lua_getstack(L, depth, &ar))
+    depth++;
+  if (!depth)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, profile->stacks_ref);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (int level=depth-1; level>=0; level--) {
+    char frame[PROFILE_FRAME_SIZE];
+    lua_getstack(L, level, &ar);
+    lua_getinfo(L, "Sn", &ar);
+    const char *name = ar.name? ar.name: *ar.what=='m'? "main chunk": "function";  // unnamed when called from C
+    if (*ar.what == 'C')
+      snprintf(frame, sizeof(frame), "%s [C]", name);
+    else
+      snprintf(frame, sizeof(frame), "%s (%s:%d)", name, ar.short_src, ar.linedefined);
+    // semicolons separate frames in folded stacks, so must not appear within a frame
+    for (char *semicolon=frame; (semicolon=strchr(semicolon, ';')); )
+      *semicolon = ',';
+    luaL_addstring(&b, frame);
+    if (level)
+      luaL_addchar(&b, ';');
   }
-  if (error) {
-    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
-    lua_pop(L, 1);  // pop error message from the stack
-    return MLUA_ERROR;
+  luaL_pushresult(&b);
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3);
+  lua_Integer count = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_pushinteger(L, count+1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);  // pop stacks table
+}
+
+// Lua count hook that samples the stack for the profiler and aborts the running call with a Lua error if it has exceeded its budget
+// Budgets and the profiler share this one hook because Lua allows only one hook per thread
+static void count_hook(lua_State *L, lua_Debug *ar) {
+  int count = lua_gethookcount(L);
+  call_budget_t *budget = Active_budget;
+  if (budget && budget->registry != lua_topointer(L, LUA_REGISTRYINDEX))
+    budget = NULL;  // this hook is in a different lua_State, e.g. one profiled but not budgeted
+  profile_t *profile;
+  if (budget)
+    profile = budget->profile;
+  else {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &Profile_key);
+    profile = lua_touserdata(L, -1);
+    lua_pop(L, 1);
   }
-  format_result(L, output, output_size);
-  return 0;
+  if (profile) {
+    profile->countdown -= count;
+    if (profile->countdown <= 0) {
+      profile->countdown = profile->interval;
+      sample_stack(L, profile);
+    }
+  }
+  if (!budget)
+    return;
+  if (budget->limit_instructions) {
+    budget->remaining -= count;
+    if (budget->remaining <= 0)
+      budget->exceeded = true;
+  }
+  if (budget->deadline && mlua_nanoseconds(0, 0) >= budget->deadline)
+    budget->exceeded = true;
+  // keep raising the error even if Lua code catches it with pcall()
+  if (budget->exceeded)
+    luaL_error(L, "MLua: call exceeded its budget");
+}
+
+#ifdef LUA_JITLIBNAME
+// Return whether LuaJIT's JIT compiler is on in lua_State L, as reported by jit.status()
+static bool jit_is_on(lua_State *L) {
+  bool on = true;  // LuaJIT's default, which Lua code cannot have changed if it has not loaded the jit library
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, LUA_JITLIBNAME);
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "status");
+    if (!lua_pcall(L, 0, 1, 0))
+      on = lua_toboolean(L, -1);
+    lua_pop(L, 1);  // pop status or error message
+  }
+  lua_pop(L, 2);
+  return on;
+}
+#endif
+
+// LuaJIT does not call hooks from JIT-compiled code, so a budget or the profiler would never fire in a compiled hot loop
+// Switch the JIT compiler off, flushing the code it has compiled, when a lua_State gets a budget or starts profiling,
+// and restore its previous mode when it has neither -- rather than on every call, which would throw away all compiled code
+static void update_jit(mlua_state_t *mlua_state) {
+#ifdef LUA_JITLIBNAME
+  budget_t *budget = &mlua_state->budget, *next = &mlua_state->next_budget;
+  bool hooked = budget->instructions || budget->microseconds || mlua_state->profile
+    || (mlua_state->next_budget_set && (next->instructions || next->microseconds));
+  lua_State *L = mlua_state->luastate;
+  if (hooked && !mlua_state->jit_off) {
+    mlua_state->jit_was_on = jit_is_on(L);
+    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_FLUSH);
+    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_OFF);
+    mlua_state->jit_off = true;
+  } else if (!hooked && mlua_state->jit_off) {
+    if (mlua_state->jit_was_on)
+      luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_ON);
+    mlua_state->jit_off = false;
+  }
+#endif
+}
+
+// Install a count hook to enforce the budget of the call about to run in the given lua_State, if it has one
+// return false without touching the lua_State if it has no budget, so that unbudgeted calls take no extra time
+// otherwise return true; the caller must then call stop_budget() when the call ends
+static bool start_budget(gtm_long_t luaState_handle, call_budget_t *call) {
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  budget_t *budget = &mlua_state->budget;
+  if (mlua_state->next_budget_set) {
+    budget = &mlua_state->next_budget;
+    mlua_state->next_budget_set = false;
+  }
+  if (!budget->instructions && !budget->microseconds)
+    return false;
+  lua_State *L = mlua_state->luastate;
+  call->limit_instructions = budget->instructions > 0;
+  call->remaining = budget->instructions;
+  call->interval = budget->interval;
+  if (call->limit_instructions && call->remaining < call->interval)
+    call->interval = call->remaining;
+  call->deadline = 0;
+  if (budget->microseconds) {
+    gtm_long_t now = mlua_nanoseconds(0, 0);
+    if (now)  // zero if the clock is not supported
+      call->deadline = now + budget->microseconds*1000;
+  }
+  call->registry = lua_topointer(L, LUA_REGISTRYINDEX);
+  call->profile = mlua_state->profile;
+  if (call->profile && call->profile->interval < call->interval)
+    call->interval = call->profile->interval;  // check the budget as often as the profiler samples
+  call->exceeded = false;
+  call->outer = Active_budget;
+  call->outer_hook = lua_gethook(L);
+  call->outer_mask = lua_gethookmask(L);
+  call->outer_count = lua_gethookcount(L);
+  Active_budget = call;
+  lua_sethook(L, count_hook, LUA_MASKCOUNT, call->interval);
+  return true;
+}
+
+// Remove the hook installed by start_budget(), restoring any budget of an enclosing call
+static void stop_budget(gtm_long_t luaState_handle, call_budget_t *call) {
+  lua_State *L = State_array->states[luaState_handle].luastate;
+  lua_sethook(L, call->outer_hook, call->outer_mask, call->outer_count);
+  Active_budget = call->outer;
+  update_jit(&State_array->states[luaState_handle]);  // a budget for this call only has now been used up
+}
+
+// Call the function on the Lua stack (below its `args` parameters) like lua_pcall() would, returning `results` results
+// Block signals if luaState_handle was opened with MLUA_BLOCK_SIGNALS, and enforce any budget set by mlua_budget()
+// return MLUA_BUDGET if the call was aborted for exceeding its budget; otherwise return the lua_pcall() status
+static int mlua_pcall(gtm_long_t luaState_handle, int args, int results) {
+  lua_State *L = State_array->states[luaState_handle].luastate;
+  int error;
+  sigset_t oldmask;
+  call_budget_t budget;
+  bool budgeted = start_budget(luaState_handle, &budget);
+  gtm_long_t times[4] = {0, 0, 0, 0};  // before and after blocking signals, running Lua, and unblocking signals
+  bool timed = State_array->states[luaState_handle].flags & MLUA_TIME_CALLS;
+  gtm_long_t metrics_start = Metrics_file? mlua_nanoseconds(0, 0): 0;  // metrics are timed apart from stats, which need MLUA_TIME_CALLS
+  if (timed) times[0] = mlua_nanoseconds(0, 0);
+  int base = lua_gettop(L) - args - 1;
+  block_signals(luaState_handle, &oldmask);
+  if (timed) times[1] = mlua_nanoseconds(0, 0);
+  updates_mark_t mark = begin_call_updates();
+  error = limited_pcall(L, State_array->states[luaState_handle].allocator, args, results);
+  if (timed) times[2] = mlua_nanoseconds(0, 0);
+  unblock_signals(luaState_handle, &oldmask);
+  if (timed) times[3] = mlua_nanoseconds(0, 0);
+  if (budgeted) {
+    stop_budget(luaState_handle, &budget);
+    if (error && budget.exceeded)
+      error = MLUA_BUDGET;
+  }
+  if (end_call_updates(mark, error) && Updates.count)
+    error = end_updates(L, error, base);
+  // Lua code may call M which may open new lua_States, realloc'ing State_array, so we look up the state afresh here
+  call_stats_t *stats = &State_array->states[luaState_handle].stats;
+  stats->calls++;
+  stats->errors += error != 0;
+  stats->signal_ns += times[1]-times[0] + times[3]-times[2];
+  stats->run_ns += times[2]-times[1];
+  if (Metrics_file)
+    publish_metrics(error != 0, mlua_nanoseconds(0, 0) - metrics_start);
+  return error;
+}
+
+// mlua_lua() helper to call the function on the Lua stack, passing it `args` string parameters taken from argp
+// in addition to `pushed` parameters already pushed onto the stack above the function
+// return 0 on success and return a string representation of the return value in .output (if supplied) or on stdout
+// or a result id >0 if the result is being streamed (see format_result())
+// return <0 on error and return the error message in .output (if supplied) or on stdout
+static gtm_int_t call_function(gtm_long_t luaState_handle, gtm_string_t *output, int output_size, int pushed, int args, va_list argp) {
+  lua_State *L = State_array->states[luaState_handle].luastate;
+  // push any optional parameters as function parameters to Lua
+  for (int i=0; i<args; i++) {
+    gtm_string_t *s = va_arg(argp, gtm_string_t*);
+    lua_pushlstring(L, s->address, s->length);
+    State_array->states[luaState_handle].stats.bytes_in += s->length;
+  }
+  int error = mlua_pcall(luaState_handle, pushed+args, 1);
+  if (error) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return error==MLUA_BUDGET? MLUA_BUDGET: MLUA_ERROR;
+  }
+  return format_result(L, luaState_handle, output, output_size);
+}
+
+// Run Lua code
+// If luaState_handle is 0 or not supplied, use the default lua_State (opening it if needed)
+// return 0 on success and return a string representation of the return value in .output (if supplied) or on stdout
+// if luaState_handle was opened with MLUA_STREAM_RESULTS and the result string is too long for .output, return the first
+//    chunk of it in .output and return a result id >0 which may be passed to mlua_fetch() to fetch the remaining chunks
+// return <0 on error and return the error message in .output (if supplied) or on stdout
+gtm_int_t mlua_lua(int argc, const gtm_string_t *code, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
+  if (argc<1) return MLUA_ERROR;  // no code to run so return error status -- but can't return output string (not supplied)
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+
+  // push function if it's a function name; otherwise compile the code
+  if (push_code(&State_array->states[luaState_handle], code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return MLUA_ERROR;
+  }
+  int args = argc-3<0? 0: argc-3;
+  va_list argp;
+  va_start(argp, luaState_handle);
+  gtm_int_t status = call_function(luaState_handle, output, output_size, 0, args, argp);
+  va_end(argp);
+  return status;
+}
+
+// Append a chunk of data to input buffer bufid so that M can stream a large argument into Lua without concatenating it in M
+// If bufid is 0, create a new input buffer; the buffer belongs to luaState_handle (0 or not supplied for the default lua_State)
+// Once complete, pass the buffer to Lua code with mlua_lua_buffer(), which frees it
+// return the buffer id >0, or MLUA_ERROR if bufid or luaState_handle is invalid or if memory could not be allocated
+gtm_long_t mlua_append(int argc, gtm_long_t bufid, const gtm_string_t *chunk, gtm_long_t luaState_handle) {
+  if (argc<1) return MLUA_ERROR;
+  if (argc<3) luaState_handle=0;
+  if (!get_luastate(luaState_handle, NULL, 0))
+    return MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+
+  if (!bufid) {
+    // find a free buffer id, allocating more if necessary
+    for (bufid=1; bufid<=mlua_state->buffers_size && mlua_state->buffers[bufid-1].data; bufid++);
+    if (bufid > mlua_state->buffers_size) {
+      input_buffer_t *buffers = realloc(mlua_state->buffers, (mlua_state->buffers_size+BUFFER_ARRAY_LUMPS) * sizeof(input_buffer_t));
+      if (!buffers)
+        return MLUA_ERROR;
+      memset(buffers+mlua_state->buffers_size, 0, BUFFER_ARRAY_LUMPS * sizeof(input_buffer_t));
+      mlua_state->buffers = buffers;
+      mlua_state->buffers_size += BUFFER_ARRAY_LUMPS;
+    }
+    input_buffer_t *buffer = &mlua_state->buffers[bufid-1];
+    buffer->data = malloc(BUFFER_INITIAL_SIZE);
+    if (!buffer->data)
+      return MLUA_ERROR;
+    buffer->size = BUFFER_INITIAL_SIZE;
+    buffer->length = 0;
+  }
+  if (bufid<0 || bufid>mlua_state->buffers_size || !mlua_state->buffers[bufid-1].data)
+    return MLUA_ERROR;
+  input_buffer_t *buffer = &mlua_state->buffers[bufid-1];
+  if (argc<2 || !chunk)
+    return bufid;
+  if (buffer->length + chunk->length > buffer->size) {
+    size_t size = buffer->size;
+    while (buffer->length + chunk->length > size)
+      size *= 2;
+    char *data = realloc(buffer->data, size);
+    if (!data)
+      return MLUA_ERROR;
+    buffer->data = data;
+    buffer->size = size;
+  }
+  memcpy(buffer->data + buffer->length, chunk->address, chunk->length);
+  buffer->length += chunk->length;
+  return bufid;
+}
+
+// Run Lua code like mlua_lua() but pass it the contents of input buffer bufid (filled by mlua_append()) as its first
+// parameter, followed by any optional string parameters. The input buffer is freed.
+// return values are as for mlua_lua()
+gtm_int_t mlua_lua_buffer(int argc, const gtm_string_t *code, gtm_string_t *output, gtm_long_t luaState_handle, gtm_long_t bufid, ...) {
+  if (argc<1) return MLUA_ERROR;  // no code to run so return error status -- but can't return output string (not supplied)
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (argc<4 || bufid<=0 || bufid>mlua_state->buffers_size || !mlua_state->buffers[bufid-1].data)
+    return outputf(output, output_size, "MLua: supplied buffer id (%li) is invalid", argc<4? 0: bufid), MLUA_ERROR;
+
+  // push function if it's a function name; otherwise compile the code
+  if (push_code(mlua_state, code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    free(mlua_state->buffers[bufid-1].data);  // the buffer is freed even if the code does not compile
+    mlua_state->buffers[bufid-1].data = NULL;
+    return MLUA_ERROR;
+  }
+  input_buffer_t *buffer = &mlua_state->buffers[bufid-1];
+  lua_pushlstring(L, buffer->data, buffer->length);
+  State_array->states[luaState_handle].stats.bytes_in += buffer->length;
+  free(buffer->data);
+  buffer->data = NULL;
+
+  int args = argc-5<0? 0: argc-5;
+  va_list argp;
+  va_start(argp, bufid);
+  gtm_int_t status = call_function(luaState_handle, output, output_size, 1, args, argp);
+  va_end(argp);
+  return status;
+}
+
+// mlua_lua_long() and mlua_lua_double() helper to run code with numeric parameters taken from argp and return a numeric result
+// if `is_double`, parameters are of type gtm_double_t* and the result is stored in *double_result;
+// otherwise parameters are of type gtm_long_t and the result is stored in *long_result
+// return 0 on success or MLUA_ERROR with the error message in .output (if supplied) or on stdout
+static gtm_int_t call_numeric(int argc, const gtm_string_t *code, bool is_double, gtm_long_t *long_result, gtm_double_t *double_result,
+                              gtm_string_t *output, gtm_long_t luaState_handle, va_list argp) {
+  if (argc<1) return MLUA_ERROR;
+  if (argc<3 || !output || !output->address) output=NULL; // don't return error string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<4) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+
+  // push function if it's a function name; otherwise compile the code
+  if (push_code(&State_array->states[luaState_handle], code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return MLUA_ERROR;
+  }
+  // push any optional parameters as numbers
+  int args = argc-4<0? 0: argc-4;
+  for (int i=0; i<args; i++) {
+    if (is_double) {
+      gtm_double_t *n = va_arg(argp, gtm_double_t*);
+      lua_pushnumber(L, n? *n: 0.0);
+    } else
+      lua_pushinteger(L, va_arg(argp, gtm_long_t));
+  }
+  int error = mlua_pcall(luaState_handle, args, 1);
+  if (error) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return error==MLUA_BUDGET? MLUA_BUDGET: MLUA_ERROR;
+  }
+
+  int isnum;
+  if (is_double) {
+    lua_Number n = lua_tonumberx(L, -1, &isnum);
+    if (isnum && double_result) *double_result = n;
+  } else {
+    lua_Integer n = lua_tointegerx(L, -1, &isnum);
+    if (isnum && long_result) *long_result = n;
+  }
+  if (!isnum) {
+    outputf(output, output_size, "MLua: function returned %s %s where %s was expected", lua_type(L, -1)==LUA_TNUMBER? "non-integer": "type", lua_type(L, -1)==LUA_TNUMBER? lua_tostring(L, -1): luaL_typename(L, -1), is_double? "a number": "an integer");
+    lua_pop(L, 1);
+    return MLUA_ERROR;
+  }
+  lua_pop(L, 1);  // pop result from the Lua stack
+  if (output) output->length = 0;
+  return 0;
+}
+
+// Run Lua code like mlua_lua() but pass it up to 8 integer parameters and return an integer result in *result
+// This avoids converting numbers to and from strings on both sides of the M/Lua boundary
+// return 0 on success or MLUA_ERROR with the error message in .output (if supplied) or on stdout
+gtm_int_t mlua_lua_long(int argc, const gtm_string_t *code, gtm_long_t *result, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
+  va_list argp;
+  va_start(argp, luaState_handle);
+  gtm_int_t status = call_numeric(argc, code, false, argc<2? NULL: result, NULL, output, luaState_handle, argp);
+  va_end(argp);
+  return status;
+}
+
+// Run Lua code like mlua_lua() but pass it up to 8 floating point parameters and return a floating point result in *result
+// return 0 on success or MLUA_ERROR with the error message in .output (if supplied) or on stdout
+gtm_int_t mlua_lua_double(int argc, const gtm_string_t *code, gtm_double_t *result, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
+  va_list argp;
+  va_start(argp, luaState_handle);
+  gtm_int_t status = call_numeric(argc, code, true, NULL, argc<2? NULL: result, output, luaState_handle, argp);
+  va_end(argp);
+  return status;
+}
+
+// Push a string representation of the Lua value at `index` formatted for natural interpretation by M, as format_result() does
+// return the string and its length in *len; the string remains valid until the caller pops it off the Lua stack
+static const char *push_m_string(lua_State *L, int index, size_t *len) {
+  index = lua_absindex(L, index);
+  int type = lua_type(L, index);
+  switch (type) {
+    case LUA_TNIL:
+      lua_pushliteral(L, "");
+      break;
+    case LUA_TBOOLEAN:
+      lua_pushstring(L, lua_toboolean(L, index)? "1": "0");
+      break;
+    case LUA_TSTRING:
+      lua_pushvalue(L, index);
+      break;
+    case LUA_TNUMBER: {
+      lua_pushvalue(L, index);  // convert a copy so that we don't alter the original (it could be a table key)
+      const char *s = lua_tolstring(L, -1, len);
+      // convert any exponential notation 'e' in a number to 'E' so YDB can understand it.
+      char *e_position = memchr(s, 'e', *len);
+      char number[64];
+      if (e_position && *len < sizeof(number)) {
+        memcpy(number, s, *len);
+        number[e_position-s] = 'E';
+        lua_pop(L, 1);
+        lua_pushlstring(L, number, *len);
+      }
+      break;
+    }
+    default:
+      lua_pushfstring(L, "(%s)", lua_typename(L, type));
+  }
+  return lua_tolstring(L, -1, len);
+}
+
+// Raise a Lua error describing YDB error `status`
+static int ydb_lua_error(lua_State *L, int status) {
+  char message[YDB_MAX_ERRORMSG];
+  ydb_zstatus(message, sizeof(message));
+  return luaL_error(L, "YDB error %d: %s", status, message);
+}
+
+// set_results() helper to set M node varname(subs) to the value on top of the Lua stack
+// tables are written as subtrees of varname(subs) keyed by the table's keys; the value is popped before return
+static void set_value(lua_State *L, ydb_buffer_t *varname, int depth, ydb_buffer_t *subs) {
+  size_t len;
+  int status;
+  if (lua_type(L, -1) != LUA_TTABLE) {
+    const char *s = push_m_string(L, -1, &len);
+    ydb_buffer_t value = {len, len, (char*)s};
+    status = ydb_set_s(varname, depth, subs, &value);
+    if (status != YDB_OK)
+      ydb_lua_error(L, status);
+    lua_pop(L, 2);  // pop string and value
+    return;
+  }
+  if (depth >= YDB_MAX_SUBS)
+    luaL_error(L, "table nesting exceeds the maximum of %d M subscripts", YDB_MAX_SUBS);
+  luaL_checkstack(L, 4, "while writing table to M");
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    int key_type = lua_type(L, -2);
+    if (key_type != LUA_TSTRING && key_type != LUA_TNUMBER && key_type != LUA_TBOOLEAN)
+      luaL_error(L, "cannot convert table key of type %s to an M subscript", lua_typename(L, key_type));
+    const char *sub = push_m_string(L, -2, &len);
+    subs[depth].buf_addr = (char*)sub;
+    subs[depth].len_alloc = subs[depth].len_used = len;
+    lua_insert(L, -2);  // keep subscript string on the stack below the value while it is in use
+    set_value(L, varname, depth+1, subs);
+    lua_pop(L, 1);  // pop subscript string, leaving the key for lua_next()
+  }
+  lua_pop(L, 1);  // pop table
+}
+
+// mlua_lua_into() helper, invoked as a protected Lua C function with arguments (varname, values...)
+// kill M local varname, then set varname=<number of values> and varname(i)=<value i>
+static int set_results(lua_State *L) {
+  size_t len;
+  const char *name = lua_tolstring(L, 1, &len);
+  ydb_buffer_t varname = {len, len, (char*)name};
+  ydb_buffer_t subs[YDB_MAX_SUBS];
+  int n = lua_gettop(L) - 1;
+  int status = ydb_delete_s(&varname, 0, NULL, YDB_DEL_TREE);
+  if (status != YDB_OK)
+    ydb_lua_error(L, status);
+  lua_pushinteger(L, n);
+  set_value(L, &varname, 0, subs);
+  for (int i=1; i<=n; i++) {
+    lua_pushinteger(L, i);
+    const char *sub = push_m_string(L, -1, &len);
+    subs[0].buf_addr = (char*)sub;
+    subs[0].len_alloc = subs[0].len_used = len;
+    lua_pushvalue(L, i+1);
+    set_value(L, &varname, 1, subs);
+    lua_pop(L, 2);  // pop subscript string and integer
+  }
+  return 0;
+}
+
+// Run Lua code like mlua_lua() but write all its return values into the M local variable named by varname
+// in a single pass, rather than returning a single string result:
+//    varname is first killed, then set to the number of values returned, and varname(i) is set to the i'th value;
+//    a table value is written as a subtree varname(i,key,...) with nested tables creating further subscripts
+// return 0 on success or MLUA_ERROR with the error message in .output (if supplied) or on stdout
+gtm_int_t mlua_lua_into(int argc, const gtm_string_t *code, const gtm_string_t *varname, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
+  if (argc<2) return MLUA_ERROR;  // no code or varname so return error status -- but can't return output string (not supplied)
+  if (argc<3 || !output || !output->address) output=NULL; // don't return error string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<4) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+
+  int base = lua_gettop(L);
+  // push function if it's a function name; otherwise compile the code
+  if (push_code(&State_array->states[luaState_handle], code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return MLUA_ERROR;
+  }
+  // push any optional parameters as function parameters to Lua
+  int args = argc-4<0? 0: argc-4;
+  va_list argp;
+  va_start(argp, luaState_handle);
+  for (int i=0; i<args; i++) {
+    gtm_string_t *s = va_arg(argp, gtm_string_t*);
+    lua_pushlstring(L, s->address, s->length);
+    State_array->states[luaState_handle].stats.bytes_in += s->length;
+  }
+  va_end(argp);
+  int error = mlua_pcall(luaState_handle, args, LUA_MULTRET);
+  if (error) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return error==MLUA_BUDGET? MLUA_BUDGET: MLUA_ERROR;
+  }
+
+  // call set_results(varname, results...) in protected mode so that errors are caught
+  if (!lua_checkstack(L, 2)) {
+    lua_settop(L, base);
+    return outputf(output, output_size, "MLua: too many results to write to M"), MLUA_ERROR;
+  }
+  int results = lua_gettop(L) - base;
+  lua_pushcfunction(L, set_results);
+  lua_insert(L, base+1);
+  lua_pushlstring(L, varname->address, varname->length);
+  lua_insert(L, base+2);
+  if (lua_pcall(L, results+1, 0, 0)) {
+    outputf(output, output_size, "MLua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return MLUA_ERROR;
+  }
+  if (output) output->length = 0;
+  return 0;
+}
+
+// define the struct of a parsed M local or global variable reference like ^name("sub",2)
+typedef struct glvn_t {
+  ydb_buffer_t varname;
+  int subs_used;
+  ydb_buffer_t subs[YDB_MAX_SUBS];
+  char *storage;  // malloc'ed storage for varname and subscripts; free after use
+} glvn_t;
+
+// Parse M variable reference `name` (of length len) into glvn, e.g. ^name("sub",2) or name
+// Subscripts may be quoted strings (with "" to embed a quote) or unquoted numbers, which are used verbatim
+// return NULL on success, otherwise a string describing the syntax error (in which case nothing needs freeing)
+static const char *parse_glvn(const char *name, size_t len, glvn_t *glvn) {
+  const char *end = name+len;
+  char *dst = glvn->storage = malloc(len+1);  // unquoting only shortens the string
+  if (!dst)
+    return "could not allocate memory";
+  glvn->subs_used = 0;
+  glvn->varname.buf_addr = dst;
+  if (name < end && (*name == '^' || *name == '%'))
+    *dst++ = *name++;
+  while (name < end && *name != '(')
+    *dst++ = *name++;
+  glvn->varname.len_alloc = glvn->varname.len_used = dst - glvn->varname.buf_addr;
+  if (name < end) {
+    name++;  // skip '('
+    do {
+      if (glvn->subs_used >= YDB_MAX_SUBS)
+        goto error;
+      ydb_buffer_t *sub = &glvn->subs[glvn->subs_used++];
+      sub->buf_addr = dst;
+      if (name < end && *name == '"') {
+        for (name++; name < end; name++) {
+          if (*name == '"') {
+            if (name+1 < end && name[1] == '"') name++;
+            else break;
+          }
+          *dst++ = *name;
+        }
+        if (name++ >= end)
+          goto error;  // no closing quote
+      } else {
+        while (name < end && *name != ',' && *name != ')')
+          *dst++ = *name++;
+        if (dst == sub->buf_addr)
+          goto error;  // empty unquoted subscript
+      }
+      sub->len_alloc = sub->len_used = dst - sub->buf_addr;
+    } while (name < end && *name++ == ',');
+    if (name != end || name[-1] != ')')
+      goto error;
+  }
+  if (!glvn->varname.len_used)
+    goto error;
+  return NULL;
+error:
+  free(glvn->storage);
+  return "invalid variable name syntax";
+}
+
+// Ensure ydb_buffer_t has space for at least `needed` bytes, reallocating its buffer if necessary
+// return false if memory could not be allocated
+static bool grow_buffer(ydb_buffer_t *buffer, unsigned int needed) {
+  if (needed <= buffer->len_alloc)
+    return true;
+  char *addr = realloc(buffer->buf_addr, needed);
+  if (!addr)
+    return false;
+  buffer->buf_addr = addr;
+  buffer->len_alloc = needed;
+  return true;
+}
+
+// Fill output with the message for YDB error status
+static void ydb_error_output(gtm_string_t *output, int output_size, int status) {
+  char message[YDB_MAX_ERRORMSG];
+  ydb_zstatus(message, sizeof(message));
+  outputf(output, output_size, "MLua: YDB error %d: %s", status, message);
+}
+
+// Apply Lua function fn (code or a function name, as accepted by mlua_lua()) to every child node of M variable
+// input_glvn (e.g. ^BCAT("lvd")), writing each result to the same subscript under output_glvn
+// fn is invoked as fn(value, subscript) for each child that has a value; a nil result does not set the output node
+// All nodes are processed within a single call so that per-call overhead (including signal blocking) is only paid once
+// return the number of nodes processed, or MLUA_ERROR with the error message in .output (if supplied) or on stdout
+gtm_long_t mlua_map(int argc, const gtm_string_t *fn, const gtm_string_t *input_glvn, const gtm_string_t *output_glvn, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<3) return MLUA_ERROR;
+  if (argc<4 || !output || !output->address) output=NULL; // don't return error string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<5) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+
+  glvn_t in, out;
+  const char *syntax_error = parse_glvn(input_glvn->address, input_glvn->length, &in);
+  if (syntax_error)
+    return outputf(output, output_size, "MLua: input variable %s", syntax_error), MLUA_ERROR;
+  syntax_error = parse_glvn(output_glvn->address, output_glvn->length, &out);
+  if (syntax_error) {
+    free(in.storage);
+    return outputf(output, output_size, "MLua: output variable %s", syntax_error), MLUA_ERROR;
+  }
+  gtm_long_t count = MLUA_ERROR;
+  ydb_buffer_t sub={0, 0, NULL}, next={0, 0, NULL}, value={0, 0, NULL};
+  if (in.subs_used >= YDB_MAX_SUBS || out.subs_used >= YDB_MAX_SUBS) {
+    outputf(output, output_size, "MLua: variable already has the maximum of %d subscripts", YDB_MAX_SUBS);
+    goto cleanup;
+  }
+  if (!grow_buffer(&sub, 1024) || !grow_buffer(&next, 1024) || !grow_buffer(&value, 65536)) {
+    outputf(output, output_size, "MLua: could not allocate memory");
+    goto cleanup;
+  }
+
+  // push function if it's a function name; otherwise compile the code
+  if (push_code(&State_array->states[luaState_handle], fn)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    goto cleanup;
+  }
+  sigset_t oldmask;
+  call_budget_t budget;
+  bool budgeted = start_budget(luaState_handle, &budget);  // budget applies to the whole map rather than each node
+  gtm_long_t metrics_start = Metrics_file? mlua_nanoseconds(0, 0): 0;
+  block_signals(luaState_handle, &oldmask);
+  updates_mark_t mark = begin_call_updates();
+  count = 0;
+  int n = in.subs_used, status;
+  in.subs[n] = sub;  // start from subscript ""
+  in.subs[n].len_used = 0;
+  while (true) {
+    status = ydb_subscript_next_s(&in.varname, n, in.subs, &next);
+    if (status == YDB_ERR_INVSTRLEN) {
+      if (!grow_buffer(&next, next.len_used)) goto nomemory;
+      continue;
+    }
+    if (status == YDB_ERR_NODEEND)
+      break;
+    if (status != YDB_OK) goto ydberror;
+    // swap buffers so that `next` becomes the current subscript
+    sub = next, next = in.subs[n], in.subs[n] = sub;
+    status = ydb_get_s(&in.varname, n+1, in.subs, &value);
+    if (status == YDB_ERR_INVSTRLEN) {
+      if (!grow_buffer(&value, value.len_used)) goto nomemory;
+      status = ydb_get_s(&in.varname, n+1, in.subs, &value);
+    }
+    if (status == YDB_ERR_LVUNDEF || status == YDB_ERR_GVUNDEF)
+      continue;  // node has children but no value
+    if (status != YDB_OK) goto ydberror;
+
+    lua_pushvalue(L, -1);  // copy of fn
+    lua_pushlstring(L, value.buf_addr, value.len_used);
+    lua_pushlstring(L, sub.buf_addr, sub.len_used);
+    State_array->states[luaState_handle].stats.bytes_in += value.len_used;
+    if (limited_pcall(L, State_array->states[luaState_handle].allocator, 2, 1)) {
+      outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+      lua_pop(L, 1);  // pop error message from the stack
+      count = budgeted && budget.exceeded? MLUA_BUDGET: MLUA_ERROR;
+      break;
+    }
+    if (!lua_isnil(L, -1)) {
+      size_t len;
+      const char *s = push_m_string(L, -1, &len);
+      ydb_buffer_t result = {len, len, (char*)s};
+      State_array->states[luaState_handle].stats.bytes_out += len;
+      out.subs[out.subs_used] = sub;
+      status = ydb_set_s(&out.varname, out.subs_used+1, out.subs, &result);
+      lua_pop(L, 1);  // pop result string
+      if (status != YDB_OK) {
+        lua_pop(L, 1);  // pop result
+        goto ydberror;
+      }
+    }
+    lua_pop(L, 1);  // pop result
+    count++;
+    continue;
+  nomemory:
+    outputf(output, output_size, "MLua: could not allocate memory");
+    count = MLUA_ERROR;
+    break;
+  ydberror:
+    ydb_error_output(output, output_size, status);
+    count = MLUA_ERROR;
+    break;
+  }
+  unblock_signals(luaState_handle, &oldmask);
+  if (budgeted)
+    stop_budget(luaState_handle, &budget);
+  if (end_call_updates(mark, count < 0) && Updates.count && end_updates(L, count < 0, lua_gettop(L)) && count >= 0) {
+    outputf(output, output_size, "%s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    count = MLUA_ERROR;
+  }
+  // count the whole map as one call
+  State_array->states[luaState_handle].stats.calls++;
+  State_array->states[luaState_handle].stats.errors += count < 0;
+  if (Metrics_file)
+    publish_metrics(count < 0, mlua_nanoseconds(0, 0) - metrics_start);
+  lua_pop(L, 1);  // pop fn
+  if (count >= 0 && output) output->length = 0;
+  sub = in.subs[n];  // in case buffers were swapped
+cleanup:
+  free(sub.buf_addr), free(next.buf_addr), free(value.buf_addr);
+  free(in.storage), free(out.storage);
+  return count;
+}
+
+// define the struct of an M variable tree read into C by mlua_lua_tree() before it is built into a Lua table
+typedef struct tree_node_t {
+  int subs;  // number of subscripts below the root variable
+  size_t first_sub;  // index into tree_t.subs of its first subscript below the root variable
+  size_t value, value_length;  // offset and length of its value in tree_t.data
+} tree_node_t;
+
+typedef struct tree_t {
+  input_buffer_t data;  // subscripts and values of all nodes
+  tree_node_t *nodes;  // nodes in M collation order, so that every subtree is a contiguous run of nodes
+  size_t nodes_used, nodes_size;
+  struct { size_t offset, length; } *subs;  // subscripts of all nodes
+  size_t subs_used, subs_size;
+} tree_t;
+
+// Append node with value and `n` subscripts to tree; return false if memory could not be allocated
+static bool append_node(tree_t *tree, int n, ydb_buffer_t *subs, ydb_buffer_t *value) {
+  if (tree->nodes_used >= tree->nodes_size) {
+    size_t size = tree->nodes_size? tree->nodes_size*2: 256;
+    tree_node_t *nodes = realloc(tree->nodes, size*sizeof(tree_node_t));
+    if (!nodes) return false;
+    tree->nodes = nodes, tree->nodes_size = size;
+  }
+  if (tree->subs_used+n > tree->subs_size) {
+    size_t size = tree->subs_size? tree->subs_size*2: 1024;
+    while (size < tree->subs_used+n) size *= 2;
+    void *subs = realloc(tree->subs, size*sizeof(*tree->subs));
+    if (!subs) return false;
+    tree->subs = subs, tree->subs_size = size;
+  }
+  tree_node_t *node = &tree->nodes[tree->nodes_used];
+  node->subs = n;
+  node->first_sub = tree->subs_used;
+  for (int i=0; i<n; i++) {
+    tree->subs[tree->subs_used+i].offset = tree->data.length;
+    tree->subs[tree->subs_used+i].length = subs[i].len_used;
+    if (write_buffer(NULL, subs[i].buf_addr, subs[i].len_used, &tree->data)) return false;
+  }
+  node->value = tree->data.length;
+  node->value_length = value->len_used;
+  if (write_buffer(NULL, value->buf_addr, value->len_used, &tree->data)) return false;
+  tree->subs_used += n;
+  tree->nodes_used++;
+  return true;
+}
+
+// return subscript `depth` of tree node i, setting *len to its length
+static const char *tree_sub(tree_t *tree, size_t i, int depth, size_t *len) {
+  size_t sub = tree->nodes[i].first_sub + depth;
+  *len = tree->subs[sub].length;
+  return tree->data.data + tree->subs[sub].offset;
+}
+
+// return the index of the first node after i (before last) whose subscript `depth` differs from that of node i
+static size_t next_sibling(tree_t *tree, size_t i, size_t last, int depth) {
+  size_t len, len2;
+  const char *sub = tree_sub(tree, i, depth, &len);
+  size_t next;
+  for (next=i+1; next<last; next++) {
+    const char *sub2 = tree_sub(tree, next, depth, &len2);
+    if (len2 != len || memcmp(sub2, sub, len)) break;
+  }
+  return next;
+}
+
+// return true if M subscript s (of length len) is a number; YDB always returns numeric subscripts in canonical form
+// set *index to true if it is a positive integer that belongs in the array part of a Lua table
+static bool is_canonic_number(const char *s, size_t len, bool *index) {
+  const char *end = s+len;
+  bool negative = s<end && *s=='-';
+  s += negative;
+  *index = false;
+  if (s<end && *s=='0') return !negative && s+1==end;  // only "0" itself may start with 0
+  const char *start = s;
+  while (s<end && *s>='0' && *s<='9') s++;
+  bool integer = s==end;
+  if (s<end && *s=='.') {
+    const char *point = s++;
+    while (s<end && *s>='0' && *s<='9') s++;
+    if (s==point+1 || s[-1]=='0') return false;
+  }
+  if (s!=end || s==start) return false;
+  *index = integer && !negative;
+  return true;
+}
+
+// Push M subscript s onto the Lua stack: as a Lua number if it is numeric so that M arrays become Lua sequences
+static void push_subscript(lua_State *L, const char *s, size_t len) {
+  bool index;
+  char number[64];
+  if (!is_canonic_number(s, len, &index) || len >= sizeof(number)) {
+    lua_pushlstring(L, s, len);
+    return;
+  }
+  memcpy(number, s, len);
+  number[len] = '\0';
+  if (!memchr(s, '.', len) && len <= 18)  // fits in 64 bits
+    lua_pushinteger(L, strtoll(number, NULL, 10));
+  else
+    lua_pushnumber(L, strtod(number, NULL));
+}
+
+// Push a table of tree nodes [first, last), which all share their first `depth` subscripts, onto the Lua stack
+// Children are keyed by their subscript; the value of a node that has children is stored in its table at key [true]
+static void push_subtree(lua_State *L, tree_t *tree, size_t first, size_t last, int depth) {
+  luaL_checkstack(L, 3, "M variable tree is too deep");
+  size_t i = first, len;
+  bool has_value = i<last && tree->nodes[i].subs == depth;
+  i += has_value;
+  // count children first so that the table is allocated at its final size
+  int narr=0, nrec=has_value;
+  for (size_t j=i; j<last; j=next_sibling(tree, j, last, depth)) {
+    bool index;
+    const char *sub = tree_sub(tree, j, depth, &len);
+    if (is_canonic_number(sub, len, &index) && index) narr++;
+    else nrec++;
+  }
+  lua_createtable(L, narr, nrec);
+  if (has_value) {
+    lua_pushboolean(L, 1);
+    lua_pushlstring(L, tree->data.data + tree->nodes[first].value, tree->nodes[first].value_length);
+    lua_rawset(L, -3);
+  }
+  for (size_t j=i, next; j<last; j=next) {
+    next = next_sibling(tree, j, last, depth);
+    const char *sub = tree_sub(tree, j, depth, &len);
+    push_subscript(L, sub, len);
+    if (next == j+1 && tree->nodes[j].subs == depth+1)  // leaf node
+      lua_pushlstring(L, tree->data.data + tree->nodes[j].value, tree->nodes[j].value_length);
+    else
+      push_subtree(L, tree, j, next, depth+1);
+    lua_rawset(L, -3);
+  }
+}
+
+// Lua C function called by mlua_lua_tree() in protected mode to build tree_t (a lightuserdata parameter) into a Lua table
+static int push_tree(lua_State *L) {
+  tree_t *tree = lua_touserdata(L, 1);
+  push_subtree(L, tree, 0, tree->nodes_used, 0);
+  return 1;
+}
+
+// mlua_lua_tree() helper to read every node of M variable glvn, with its subscripts, into tree
+// return YDB_OK on success; otherwise a YDB error status, or set *nomemory if memory could not be allocated
+static int read_tree(glvn_t *glvn, tree_t *tree, bool *nomemory) {
+  ydb_buffer_t value={0, 0, NULL};
+  ydb_buffer_t node_subs[2][YDB_MAX_SUBS];  // current and next node
+  memset(node_subs, 0, sizeof(node_subs));
+  ydb_buffer_t *subs = node_subs[0], *next = node_subs[1];
+  int n = glvn->subs_used, status = YDB_OK;
+  *nomemory = true;
+  if (!grow_buffer(&value, 65536)) goto cleanup;
+  for (int i=0; i<YDB_MAX_SUBS; i++)
+    if (!grow_buffer(&node_subs[0][i], 256) || !grow_buffer(&node_subs[1][i], 256)) goto cleanup;
+  // start at the root node itself, which may have a value
+  for (int i=0; i<n; i++) {
+    if (!grow_buffer(&subs[i], glvn->subs[i].len_used)) goto cleanup;
+    memcpy(subs[i].buf_addr, glvn->subs[i].buf_addr, glvn->subs[i].len_used);
+    subs[i].len_used = glvn->subs[i].len_used;
+  }
+  int subs_used = n;
+  bool root = true;
+  while (true) {
+    status = ydb_get_s(&glvn->varname, subs_used, subs, &value);
+    if (status == YDB_ERR_INVSTRLEN) {
+      if (!grow_buffer(&value, value.len_used)) goto cleanup;
+      status = ydb_get_s(&glvn->varname, subs_used, subs, &value);
+    }
+    if (status == YDB_OK) {
+      if (!append_node(tree, subs_used-n, subs+n, &value)) goto cleanup;
+    } else if (!(root && (status == YDB_ERR_LVUNDEF || status == YDB_ERR_GVUNDEF)))
+      break;
+    root = false;
+    int next_used;
+    do {
+      next_used = YDB_MAX_SUBS;
+      status = ydb_node_next_s(&glvn->varname, subs_used, subs, &next_used, next);
+      if (status == YDB_ERR_INVSTRLEN && !grow_buffer(&next[next_used], next[next_used].len_used)) goto cleanup;
+    } while (status == YDB_ERR_INVSTRLEN);
+    if (status == YDB_ERR_NODEEND) {
+      status = YDB_OK;
+      break;
+    }
+    if (status != YDB_OK) break;
+    // stop once the next node is outside glvn's subtree
+    bool inside = next_used > n;
+    for (int i=0; inside && i<n; i++)
+      inside = next[i].len_used == glvn->subs[i].len_used && !memcmp(next[i].buf_addr, glvn->subs[i].buf_addr, next[i].len_used);
+    if (!inside) {
+      status = YDB_OK;
+      break;
+    }
+    ydb_buffer_t *swap = subs;
+    subs = next, next = swap, subs_used = next_used;
+  }
+  *nomemory = false;
+cleanup:
+  for (int i=0; i<YDB_MAX_SUBS; i++)
+    free(node_subs[0][i].buf_addr), free(node_subs[1][i].buf_addr);
+  free(value.buf_addr);
+  return status;
+}
+
+// Like mlua_lua() but first read the whole M variable tree glvn (e.g. rec or ^BCAT("lvd")) in C and pass it to the Lua
+// function as a nested table in its first parameter, followed by any optional string parameters
+// Subscripts become table keys (numbers if numeric) and node values become strings; see push_subtree()
+// return values are the same as for mlua_lua()
+gtm_int_t mlua_lua_tree(int argc, const gtm_string_t *code, gtm_string_t *output, gtm_long_t luaState_handle, const gtm_string_t *glvn, ...) {
+  if (argc<1) return MLUA_ERROR;
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+  if (argc<4 || !glvn)
+    return outputf(output, output_size, "MLua: no variable name supplied"), MLUA_ERROR;
+
+  glvn_t var;
+  const char *syntax_error = parse_glvn(glvn->address, glvn->length, &var);
+  if (syntax_error)
+    return outputf(output, output_size, "MLua: variable %s", syntax_error), MLUA_ERROR;
+  tree_t tree;
+  memset(&tree, 0, sizeof(tree));
+  bool nomemory;
+  int status = read_tree(&var, &tree, &nomemory);
+  free(var.storage);
+  gtm_int_t result = MLUA_ERROR;
+  if (nomemory) {
+    outputf(output, output_size, "MLua: could not allocate memory");
+    goto cleanup;
+  }
+  if (status != YDB_OK) {
+    ydb_error_output(output, output_size, status);
+    goto cleanup;
+  }
+
+  // push function if it's a function name; otherwise compile the code
+  if (push_code(&State_array->states[luaState_handle], code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    goto cleanup;
+  }
+  lua_pushcfunction(L, push_tree);
+  lua_pushlightuserdata(L, &tree);
+  if (limited_pcall(L, State_array->states[luaState_handle].allocator, 1, 1)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 2);  // pop error message and function
+    goto cleanup;
+  }
+  State_array->states[luaState_handle].stats.bytes_in += tree.data.length;
+  free(tree.data.data), free(tree.nodes), free(tree.subs);
+  memset(&tree, 0, sizeof(tree));  // the Lua table now holds the tree, so free the C copy before the call
+  int args = argc-4<0? 0: argc-4;
+  va_list argp;
+  va_start(argp, glvn);
+  result = call_function(luaState_handle, output, output_size, 1, args, argp);
+  va_end(argp);
+cleanup:
+  free(tree.data.data), free(tree.nodes), free(tree.subs);
+  return result;
+}
+
+// Prepare Lua code or a function name (in the same format as mlua_lua() accepts) for repeated calls by mlua_call()
+// The function is compiled or looked up just once and a reference to it kept in the lua_State's registry
+// If luaState_handle is 0 or not supplied, use the default lua_State (opening it if needed)
+// return a function handle >0 for use with mlua_call(); or 0 on error with the error message in .output (if supplied) or on stdout
+gtm_long_t mlua_prepare(int argc, const gtm_string_t *code, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<1) return 0;
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return 0;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+
+  if (push_code(mlua_state, code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return 0;
+  }
+  // create registry table of prepared functions if it doesn't yet exist
+  if (!mlua_state->prepared_ref) {
+    lua_newtable(L);
+    mlua_state->prepared_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->prepared_ref);
+  lua_insert(L, -2);  // place the table below the function
+  gtm_long_t function_handle = luaL_ref(L, -2);  // pops the function
+  lua_pop(L, 1);  // pop the table
+  outputf(output, output_size, "");
+  return function_handle;
+}
+
+// Call a function prepared by mlua_prepare(), passing it any optional string parameters
+// luaState_handle must be the same handle that was passed to mlua_prepare() (0 or not supplied for the default lua_State)
+// return 0 on success and return a string representation of the return value in .output (if supplied) or on stdout
+// return <0 on error and return the error message in .output (if supplied) or on stdout
+gtm_int_t mlua_call(int argc, gtm_long_t function_handle, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
+  if (argc<1) return MLUA_ERROR;
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+  int prepared_ref = State_array->states[luaState_handle].prepared_ref;
+  if (!prepared_ref || function_handle<=0)
+    return outputf(output, output_size, "MLua: supplied function handle (%li) is invalid", function_handle), MLUA_ERROR;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, prepared_ref);
+  lua_rawgeti(L, -1, function_handle);
+  lua_remove(L, -2);  // drop table of prepared functions
+  if (lua_type(L, -1) != LUA_TFUNCTION) {  // unused or released references contain other types
+    lua_pop(L, 1);
+    return outputf(output, output_size, "MLua: supplied function handle (%li) is invalid", function_handle), MLUA_ERROR;
+  }
+  int args = argc-3<0? 0: argc-3;
+  va_list argp;
+  va_start(argp, luaState_handle);
+  gtm_int_t status = call_function(luaState_handle, output, output_size, 0, args, argp);
+  va_end(argp);
+  return status;
+}
+
+// Release a function handle returned by mlua_prepare() so that the function may be garbage collected
+// return 0 on success or -1 if the function handle or luaState_handle is invalid
+gtm_int_t mlua_unprepare(int argc, gtm_long_t function_handle, gtm_long_t luaState_handle) {
+  if (argc<1) return -1;
+  if (argc<2) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return -1;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  lua_State *L = mlua_state->luastate;
+  if (!mlua_state->prepared_ref || function_handle<=0)
+    return -1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->prepared_ref);
+  int type = lua_rawgeti(L, -1, function_handle);
+  lua_pop(L, 1);
+  if (type == LUA_TFUNCTION)
+    luaL_unref(L, -1, function_handle);
+  lua_pop(L, 1);
+  return type == LUA_TFUNCTION? 0: -1;
+}
+
+// Resume coroutine co with nargs arguments on its stack, in any Lua version
+// return its status, with the number of values it yielded or returned (on top of its stack) in *nres
+static int resume(lua_State *co, lua_State *from, int nargs, int *nres) {
+#if LUA_VERSION_NUM >= 504
+  return lua_resume(co, from, nargs, nres);
+#else
+  int status = lua_resume(co, from, nargs);
+  *nres = lua_gettop(co);  // before Lua 5.4, the stack holds only the yielded or returned values
+  return status;
+#endif
+}
+
+// mlua_co_next() helper to resume the coroutine given as parameter 1 so that mlua_pcall() can run it like any other call
+// The first resume passes the function the arguments that mlua_co_start() left on the coroutine's stack
+// return the first value it yields (or returns), and true as a second result if it has returned; raise any error it raises
+// Lua C function so that it can be called with protected pcall
+static int resume_coroutine(lua_State *L) {
+  lua_State *co = lua_tothread(L, 1);
+  // hooks are per-coroutine, so apply the caller's budget or profiler hook to the coroutine
+  lua_sethook(co, lua_gethook(L), lua_gethookmask(L), lua_gethookcount(L));
+  int nargs = lua_status(co) == LUA_YIELD? 0: lua_gettop(co)-1;
+  int nres, status = resume(co, L, nargs, &nres);
+  if (status != LUA_OK && status != LUA_YIELD) {
+    lua_xmove(co, L, 1);  // error message
+    return lua_error(L);
+  }
+  if (nres) {
+    lua_pushvalue(co, -nres);
+    lua_xmove(co, L, 1);
+  } else
+    lua_pushnil(L);
+  lua_pop(co, nres);
+  lua_pushboolean(L, status == LUA_OK);
+  return 2;
+}
+
+// Start Lua code (or a '>' function name, as for mlua_lua()) as a coroutine with up to 8 optional string parameters,
+// without running it yet. Each mlua_co_next() then runs it until it yields a value to M
+// return a coroutine handle >0, or 0 on error with the error message in .output (if supplied) or on stdout
+gtm_long_t mlua_co_start(int argc, const gtm_string_t *code, gtm_string_t *output, gtm_long_t luaState_handle, ...) {
+  if (argc<1) return 0;
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return 0;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+
+  // create registry table of coroutines if it doesn't yet exist
+  if (!mlua_state->coroutines_ref) {
+    lua_newtable(L);
+    mlua_state->coroutines_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->coroutines_ref);
+  lua_State *co = lua_newthread(L);
+  if (push_code(mlua_state, code)) {
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 3);  // pop error message, coroutine and table
+    return 0;
+  }
+  lua_xmove(L, co, 1);  // move function to the coroutine
+  int args = argc-3<0? 0: argc-3;
+  va_list argp;
+  va_start(argp, luaState_handle);
+  for (int i=0; i<args; i++) {
+    gtm_string_t *s = va_arg(argp, gtm_string_t*);
+    lua_pushlstring(co, s->address, s->length);
+    mlua_state->stats.bytes_in += s->length;
+  }
+  va_end(argp);
+  gtm_long_t co_handle = luaL_ref(L, -2);  // pops the coroutine
+  lua_pop(L, 1);  // pop the table
+  outputf(output, output_size, "");
+  return co_handle;
+}
+
+// Run coroutine co_handle from mlua_co_start() until it yields, and return 0 with the first value it yielded in .output
+// luaState_handle must be the same handle that was passed to mlua_co_start() (0 or not supplied for the default lua_State)
+// When the function returns, return MLUA_DONE with its return value in .output and release the coroutine handle
+// return <0 on error with the error message in .output (if supplied) or on stdout, also releasing the coroutine handle
+gtm_int_t mlua_co_next(int argc, gtm_long_t co_handle, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<1) return MLUA_ERROR;
+  if (argc<2 || !output || !output->address) output=NULL; // don't return output string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0; // use default lua_State
+  lua_State *L = get_luastate(luaState_handle, output, output_size);
+  if (!L)
+    return MLUA_ERROR;
+  int coroutines_ref = State_array->states[luaState_handle].coroutines_ref;
+  if (!coroutines_ref || co_handle<=0)
+    return outputf(output, output_size, "MLua: supplied coroutine handle (%li) is invalid", co_handle), MLUA_ERROR;
+  lua_pushcfunction(L, resume_coroutine);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, coroutines_ref);
+  lua_rawgeti(L, -1, co_handle);
+  lua_remove(L, -2);  // drop table of coroutines
+  if (lua_type(L, -1) != LUA_TTHREAD) {  // unused or released references contain other types
+    lua_pop(L, 2);
+    return outputf(output, output_size, "MLua: supplied coroutine handle (%li) is invalid", co_handle), MLUA_ERROR;
+  }
+  int error = mlua_pcall(luaState_handle, 1, 2);
+  if (error) {
+    mlua_co_release(2, co_handle, luaState_handle);
+    outputf(output, output_size, "Lua: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return error==MLUA_BUDGET? MLUA_BUDGET: MLUA_ERROR;
+  }
+  bool done = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (done)
+    mlua_co_release(2, co_handle, luaState_handle);
+  gtm_int_t status = format_result(L, luaState_handle, output, output_size);
+  return done? MLUA_DONE: status;
+}
+
+// Release a coroutine handle returned by mlua_co_start() before it is done so that the coroutine may be garbage collected
+// return 0 on success or -1 if the coroutine handle or luaState_handle is invalid
+gtm_int_t mlua_co_release(int argc, gtm_long_t co_handle, gtm_long_t luaState_handle) {
+  if (argc<1) return -1;
+  if (argc<2) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return -1;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  lua_State *L = mlua_state->luastate;
+  if (!mlua_state->coroutines_ref || co_handle<=0)
+    return -1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->coroutines_ref);
+  int type = lua_rawgeti(L, -1, co_handle);
+  lua_pop(L, 1);
+  if (type == LUA_TTHREAD)
+    luaL_unref(L, -1, co_handle);
+  lua_pop(L, 1);
+  return type == LUA_TTHREAD? 0: -1;
+}
+
+// Fetch the next chunk of a large result string into .output, given a result id returned by mlua_lua() or mlua_call()
+// luaState_handle must be the same handle that produced the result (0 or not supplied for the default lua_State)
+// return the number of bytes still remaining after this chunk; when it returns 0, the result id is released automatically
+// return MLUA_ERROR with the error message in .output (if supplied) if the result id is invalid
+gtm_long_t mlua_fetch(int argc, gtm_long_t id, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<2 || !output || !output->address) return MLUA_ERROR;  // no output to fetch into
+  int output_size = output->length; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (id<=0 || id>mlua_state->results_size || !mlua_state->results[id-1].data)
+    return outputf(output, output_size, "MLua: supplied result id (%li) is invalid", id), MLUA_ERROR;
+  pinned_result_t *result = &mlua_state->results[id-1];
+  size_t len = result->length - result->offset;
+  if (len > output_size)
+    len = output_size;
+  memcpy(output->address, result->data + result->offset, len);
+  output->length = len;
+  result->offset += len;
+  mlua_state->stats.bytes_out += len;
+  gtm_long_t remaining = result->length - result->offset;
+  if (!remaining)
+    release_result(mlua_state->luastate, mlua_state, id);
+  return remaining;
+}
+
+// Release a result id returned by mlua_lua() or mlua_call() before all of its chunks have been fetched
+// return 0 on success or -1 if the result id or luaState_handle is invalid
+gtm_int_t mlua_release(int argc, gtm_long_t id, gtm_long_t luaState_handle) {
+  if (argc<1) return -1;
+  if (argc<2) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return -1;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (id<=0 || id>mlua_state->results_size || !mlua_state->results[id-1].data)
+    return -1;
+  release_result(mlua_state->luastate, mlua_state, id);
+  return 0;
+}
+
+// Return statistics about the cache of compiled code strings for luaState_handle (or the default lua_State if 0)
+// output is filled with M-parsable comma-separated name=value pairs: hits=<n>,misses=<n>,entries=<n>,size=<n>
+// return 0 on success or MLUA_ERROR if the handle is invalid, with the error message in output
+gtm_int_t mlua_cache_stats(int argc, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<1 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<2) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  int entries = 0;
+  for (cache_entry_t *entry=mlua_state->cache; entry < mlua_state->cache+CODE_CACHE_SIZE; entry++)
+    entries += entry->hash != 0;
+  outputf(output, output_size, "hits=%lu,misses=%lu,entries=%d,size=%d", mlua_state->cache_hits, mlua_state->cache_misses, entries, CODE_CACHE_SIZE);
+  return 0;
+}
+
+// Return statistics on the memory allocated by Lua in the given lua_State
+// If luaState_handle is not supplied, use the default lua_State
+// On success, return 0 with output containing "inuse=<bytes>,peak=<bytes>,pooled=<blocks>,free=<blocks>,slabs=<bytes>"
+// where pooled and free are the number of pool blocks allocated to Lua and in the free lists, and slabs is the memory given to pools
+// On error, return MLUA_ERROR with output containing the error message (e.g. if the Lua implementation does not support custom allocators)
+gtm_int_t mlua_alloc_stats(int argc, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<1 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<2) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+  allocator_t *allocator = State_array->states[luaState_handle].allocator;
+  if (!allocator)
+    return outputf(output, output_size, "MLua: this Lua implementation does not support the MLua allocator"), MLUA_ERROR;
+  size_t pooled = 0;
+  for (int class=0; class<POOL_CLASSES; class++)
+    pooled += allocator->blocks_used[class];
+  outputf(output, output_size, "inuse=%zu,peak=%zu,pooled=%zu,free=%zu,slabs=%zu",
+    allocator->in_use, allocator->peak, pooled, allocator->blocks_free, allocator->slab_bytes);
+  return 0;
+}
+
+// Return the number of bytes currently allocated by the given lua_State, or MLUA_ERROR if the handle is invalid
+// If luaState_handle is not supplied, use the default lua_State
+// If peak is supplied, also return in it the maximum number of bytes the lua_State has had allocated at once
+gtm_long_t mlua_memory(int argc, gtm_long_t luaState_handle, gtm_long_t *peak) {
+  if (argc<1) luaState_handle=0;
+  if (argc<2) peak=NULL;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  gtm_long_t in_use;
+  if (mlua_state->allocator) {
+    in_use = mlua_state->allocator->in_use;
+    if (peak) *peak = mlua_state->allocator->peak;
+  } else {
+    // the Lua implementation does not support our allocator, so ask Lua, which cannot tell us the peak
+    lua_State *L = mlua_state->luastate;
+    in_use = (gtm_long_t)lua_gc(L, LUA_GCCOUNT, 0)*1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+    if (peak) *peak = in_use;
+  }
+  return in_use;
+}
+
+// Set the budget of Lua instructions and/or real time that calls into the given lua_State may use
+// A call that exceeds its budget is aborted with a Lua error and the calling function returns MLUA_BUDGET
+// instructions and microseconds are the limits per call, where 0 means no limit; if both are 0 the lua_State has no budget,
+//    in which case calls run with no hook installed and thus no overhead
+// interval is the number of Lua instructions between budget checks (default BUDGET_INTERVAL): smaller is more precise but slower
+// If next_call_only is nonzero, the budget applies only to the next call, overriding the lua_State's own budget
+// If luaState_handle is not supplied, use the default lua_State
+// return 0 on success or MLUA_ERROR if a parameter is invalid
+gtm_int_t mlua_budget(int argc, gtm_long_t luaState_handle, gtm_long_t instructions, gtm_long_t microseconds, gtm_int_t interval, gtm_int_t next_call_only) {
+  if (argc<1) luaState_handle=0;
+  if (argc<2) instructions=0;
+  if (argc<3) microseconds=0;
+  if (argc<4 || !interval) interval=BUDGET_INTERVAL;
+  if (argc<5) next_call_only=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return MLUA_ERROR;
+  if (instructions<0 || microseconds<0 || interval<0)
+    return MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  budget_t *budget = next_call_only? &mlua_state->next_budget: &mlua_state->budget;
+  budget->instructions = instructions;
+  budget->microseconds = microseconds;
+  budget->interval = interval;
+  if (next_call_only)
+    mlua_state->next_budget_set = true;
+  update_jit(mlua_state);
+  return 0;
+}
+
+// Return counters of the work done by the given lua_State, in M-parsable output:
+//    "calls=<n>,errors=<n>,compiles=<n>,compile_ns=<n>,run_ns=<n>,signal_ns=<n>,bytes_in=<n>,bytes_out=<n>,truncations=<n>"
+// Times are only measured in lua_States opened with MLUA_TIME_CALLS, and are zero otherwise
+// If luaState_handle is -1, return totals of every lua_State this process has opened, including closed ones,
+//    followed by ",bytecode_hits=<n>": the number of chunks loaded from the bytecode cache rather than compiled
+// If luaState_handle is not supplied, use the default lua_State
+// return 0 on success or MLUA_ERROR with the error message in output
+gtm_int_t mlua_stats(int argc, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<1 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<2) luaState_handle=0;
+  call_stats_t stats;
+  if (luaState_handle == -1) {
+    stats = Closed_stats;
+    for (int i=0; State_array && i<State_array->used; i++)
+      if (State_array->states[i].luastate)
+        add_stats(&stats, &State_array->states[i].stats);
+  } else {
+    if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+      return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+    stats = State_array->states[luaState_handle].stats;
+  }
+  char process_totals[40] = "";
+  if (luaState_handle == -1)
+    snprintf(process_totals, sizeof(process_totals), ",bytecode_hits=%llu", (unsigned long long)Bytecode_hits);
+  outputf(output, output_size, "calls=%llu,errors=%llu,compiles=%llu,compile_ns=%llu,run_ns=%llu,signal_ns=%llu,bytes_in=%llu,bytes_out=%llu,truncations=%llu%s",
+    (unsigned long long)stats.calls, (unsigned long long)stats.errors, (unsigned long long)stats.compiles,
+    (unsigned long long)stats.compile_ns, (unsigned long long)stats.run_ns, (unsigned long long)stats.signal_ns,
+    (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out, (unsigned long long)stats.truncations, process_totals);
+  return 0;
+}
+
+// Start sampling the Lua call stack of the given lua_State every `interval` Lua instructions, discarding any previous samples
+// Samples are taken by a Lua count hook rather than a timer signal so as not to interfere with the signals YDB uses
+// If interval is 0, stop profiling and discard the samples
+// If luaState_handle is not supplied, use the default lua_State
+// return 0 on success or MLUA_ERROR if a parameter is invalid
+gtm_int_t mlua_profile(int argc, gtm_long_t luaState_handle, gtm_int_t interval) {
+  if (argc<1) luaState_handle=0;
+  if (argc<2) interval=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return MLUA_ERROR;
+  if (interval<0)
+    return MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  lua_State *L = mlua_state->luastate;
+  if (mlua_state->profile) {
+    luaL_unref(L, LUA_REGISTRYINDEX, mlua_state->profile->stacks_ref);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &Profile_key);
+    mlua_state->profile = NULL;
+    lua_sethook(L, NULL, 0, 0);
+  }
+  if (!interval) {
+    update_jit(mlua_state);
+    return 0;
+  }
+  profile_t *profile = lua_newuserdata(L, sizeof(profile_t));
+  profile->interval = profile->countdown = interval;
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &Profile_key);
+  lua_newtable(L);
+  profile->stacks_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  mlua_state->profile = profile;
+  lua_sethook(L, count_hook, LUA_MASKCOUNT, interval);
+  update_jit(mlua_state);
+  return 0;
+}
+
+// Write the samples collected by mlua_profile() to the file named `filename`, in the folded-stack format that
+// flamegraph.pl (https://github.com/brendangregg/FlameGraph) takes as input: one "frame;...;frame count" line per distinct stack
+// Samples are kept, so that later dumps include them
+// If luaState_handle is not supplied, use the default lua_State
+// return 0 on success or MLUA_ERROR with the error message in output
+gtm_int_t mlua_profile_dump(int argc, const gtm_string_t *filename, gtm_string_t *output, gtm_long_t luaState_handle) {
+  if (argc<2 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) luaState_handle=0;
+  if (argc<1)
+    return outputf(output, output_size, "MLua: no filename supplied to dump profile to"), MLUA_ERROR;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (!mlua_state->profile)
+    return outputf(output, output_size, "MLua: luaState (%li) is not being profiled", luaState_handle), MLUA_ERROR;
+  char *name = malloc(filename->length+1);
+  if (!name)
+    return outputf(output, output_size, "MLua: could not allocate memory"), MLUA_ERROR;
+  memcpy(name, filename->address, filename->length);
+  name[filename->length] = '\0';
+  FILE *f = fopen(name, "w");
+  free(name);
+  if (!f)
+    return outputf(output, output_size, "MLua: could not open profile dump file: %s", strerror(errno)), MLUA_ERROR;
+  lua_State *L = mlua_state->luastate;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->profile->stacks_ref);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    fprintf(f, "%s %lld\n", lua_tostring(L, -2), (long long)lua_tointeger(L, -1));
+    lua_pop(L, 1);  // pop count, leaving the key for lua_next()
+  }
+  lua_pop(L, 1);  // pop stacks table
+  if (fclose(f))
+    return outputf(output, output_size, "MLua: could not write profile dump file: %s", strerror(errno)), MLUA_ERROR;
+  outputf(output, output_size, "");
+  return 0;
+}
+
+// Return a lua_State opened with MLUA_RESETTABLE to its condition just after it was opened (after MLUA_INIT ran),
+// far faster than closing it and opening a new one
+// Restores the globals table, package.loaded, and the contents of the tables they contained (e.g. library and module tables),
+// but not changes made deeper inside those tables or to upvalues
+// Also discards prepared functions, coroutines, results being streamed and input buffers; keeps budgets, profiling, statistics and the code cache
+// return 0 on success or MLUA_ERROR with the error message in output (if supplied)
+gtm_int_t mlua_reset(int argc, gtm_long_t luaState_handle, gtm_string_t *output) {
+  if (argc<2 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<1) luaState_handle=0;
+  if (!State_array || luaState_handle<0 || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return outputf(output, output_size, "MLua: supplied luaState (%li) is invalid", luaState_handle), MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (!mlua_state->baseline_ref)
+    return outputf(output, output_size, "MLua: luaState (%li) was not opened with MLUA_RESETTABLE", luaState_handle), MLUA_ERROR;
+  lua_State *L = mlua_state->luastate;
+  lua_pushcfunction(L, restore_baseline);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mlua_state->baseline_ref);
+  if (lua_pcall(L, 1, 0, 0)) {
+    outputf(output, output_size, "MLua: could not reset luaState, %s", lua_tostring(L, -1));
+    lua_pop(L, 1);  // pop error message from the stack
+    return MLUA_ERROR;
+  }
+  if (mlua_state->prepared_ref) {
+    luaL_unref(L, LUA_REGISTRYINDEX, mlua_state->prepared_ref);
+    mlua_state->prepared_ref = 0;
+  }
+  if (mlua_state->coroutines_ref) {
+    luaL_unref(L, LUA_REGISTRYINDEX, mlua_state->coroutines_ref);
+    mlua_state->coroutines_ref = 0;
+  }
+  for (int id=1; id<=mlua_state->results_size; id++)
+    if (mlua_state->results[id-1].data)
+      release_result(L, mlua_state, id);
+  free_buffers(mlua_state);
+  mlua_state->next_budget_set = false;
+  outputf(output, output_size, "");
+  return 0;
+}
+
+// Return a lua_State from the pool of pre-initialized states that was opened with the given flags,
+// resetting it if needed; if there is none, open a new one with flags|MLUA_RESETTABLE
+// The pool only opens lua_States with mlua_open()'s defaults otherwise (no memory limit and all libraries),
+// and takes back only the ones it opened, so lua_States with the same flags are equivalent
+// When finished with it, return it to the pool with mlua_pool_put() rather than closing it
+// return the lua_State handle, or 0 on error with the error message in output (if supplied)
+gtm_long_t mlua_pool_get(int argc, gtm_string_t *output, gtm_int_t flags) {
+  if (argc<1 || !output || !output->address) output=NULL;
+  if (argc<2) flags=0;
+  flags |= MLUA_RESETTABLE;
+  for (gtm_long_t handle=1; State_array && handle<State_array->used; handle++) {
+    mlua_state_t *mlua_state = &State_array->states[handle];
+    if (mlua_state->luastate && mlua_state->pooled && mlua_state->flags == flags) {
+      mlua_state->pooled = false;
+      if (output) output->length = 0;
+      return handle;
+    }
+  }
+  gtm_long_t handle = mlua_open(2, output, flags, 0, NULL);
+  if (handle)
+    State_array->states[handle].from_pool = true;
+  return handle;
+}
+
+// Reset a lua_State obtained from mlua_pool_get() (see mlua_reset()) and return it to the pool for reuse
+// Unlike mlua_reset(), also clear its budget, stop profiling and restart its statistics and memory peak,
+// so that the next mlua_pool_get() caller inherits nothing of this one's; only its code cache of compiled code is kept
+// If it cannot be reset, close it instead
+// return 0 on success or MLUA_ERROR if the handle is invalid, was not obtained from the pool, or could not be reset
+gtm_int_t mlua_pool_put(int argc, gtm_long_t luaState_handle) {
+  if (argc<1 || luaState_handle<=0 || !State_array || luaState_handle>=State_array->used || !State_array->states[luaState_handle].luastate)
+    return MLUA_ERROR;
+  mlua_state_t *mlua_state = &State_array->states[luaState_handle];
+  if (!mlua_state->from_pool)
+    return MLUA_ERROR;
+  if (mlua_state->pooled)
+    return 0;  // already in the pool
+  if (mlua_reset(1, luaState_handle, NULL)) {
+    mlua_close(1, luaState_handle);
+    return MLUA_ERROR;
+  }
+  memset(&mlua_state->budget, 0, sizeof(mlua_state->budget));
+  mlua_profile(2, luaState_handle, 0);  // also lets update_jit() see that the budget is gone
+  add_stats(&Closed_stats, &mlua_state->stats);  // keep the process totals of mlua_stats()
+  memset(&mlua_state->stats, 0, sizeof(mlua_state->stats));
+  if (mlua_state->allocator)
+    mlua_state->allocator->peak = mlua_state->allocator->in_use;
+  mlua_state->pooled = true;
+  return 0;
+}
+
+// Pre-initialize lua_States with the given flags and put them in the pool, until the pool holds `count` states with those flags,
+// so that later mlua_pool_get() calls do not pay for opening them
+// return the number of lua_States in the pool with those flags, or MLUA_ERROR on error with the error message in output (if supplied)
+gtm_long_t mlua_pool_fill(int argc, gtm_long_t count, gtm_string_t *output, gtm_int_t flags) {
+  if (argc<2 || !output || !output->address) output=NULL;
+  if (argc<1) count=0;
+  if (argc<3) flags=0;
+  flags |= MLUA_RESETTABLE;
+  gtm_long_t pooled = 0;
+  for (gtm_long_t handle=1; State_array && handle<State_array->used; handle++)
+    pooled += State_array->states[handle].luastate && State_array->states[handle].pooled && State_array->states[handle].flags == flags;
+  for (; pooled<count; pooled++) {
+    gtm_long_t handle = mlua_open(2, output, flags, 0, NULL);
+    if (!handle)
+      return MLUA_ERROR;
+    State_array->states[handle].pooled = State_array->states[handle].from_pool = true;
+  }
+  return pooled;
+}
+
+
+// ~~~ Worker threads that run pure-Lua jobs submitted by mlua_submit() so that M can overlap them with its own work
+// The worker threads run until the process exits. Each has its own lua_State, which environment variable MLUA_WORKER_MEMORY
+// may limit to a number of bytes, as mlua_open()'s memory_limit does
+
+#define MAX_JOB_ARGS 8 /* maximum number of string arguments to a job, as for mlua_lua() */
+#define JOB_ARRAY_LUMPS 16 /* increment the job array in lumps of this many jobs */
+
+// define the struct of a job submitted to the worker threads
+typedef struct job_t {
+  enum {JOB_QUEUED, JOB_RUNNING, JOB_DONE} status;
+  bool failed;  // true if the job raised an error, in which case result is the error message
+  char *code;  // malloc'ed, NUL-terminated copy of the code string or '>' function name
+  size_t code_length;
+  int args;  // number of arguments
+  char *arg[MAX_JOB_ARGS];  // malloc'ed copies of the arguments
+  size_t arg_length[MAX_JOB_ARGS];
+  struct batch_t *batch;  // for mlua_pmap(), the nodes to apply the function to; otherwise NULL
+  char *result;  // malloc'ed result string (formatted as by mlua_lua()) once the job is done
+  size_t result_length;
+  atomic_bool cancelled;  // set by mlua_cancel(): the worker aborts the job and frees it when done, since its id is released
+  struct job_t *next;  // next job in the queue
+} job_t;
+
+// define the struct of a batch of M nodes that mlua_pmap() sends to a worker thread as one job
+// Records in the buffers are each a size_t length followed by that many bytes; a length of SIZE_MAX has no bytes and means nil
+typedef struct batch_t {
+  int nodes;  // number of nodes in the batch
+  input_buffer_t input;  // value then subscript records of each node
+  input_buffer_t output;  // result record of each node, filled in by the worker
+} batch_t;
+
+// Jobs and their queue are shared with the worker threads, so are accessed only while holding Jobs_lock
+static pthread_mutex_t Jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Job_queued = PTHREAD_COND_INITIALIZER;  // signalled when a job is queued
+static pthread_cond_t Job_done = PTHREAD_COND_INITIALIZER;  // broadcast when a job is done
+static job_t **Jobs;  // jobs indexed by job id-1; NULL where the id is free
+static int Jobs_size;  // number of elements allocated in Jobs
+static job_t *Queue_head, *Queue_tail;  // queue of jobs not yet taken by a worker
+static int Workers;  // number of worker threads running
+static pid_t Workers_pid;  // process that started the workers, or 0 if none: a forked child must start its own
+static _Thread_local job_t *Worker_job;  // job that this worker thread is running, for worker_hook()
+
+// Preload function for the yottadb and mlua modules in worker lua_States: YDB is not thread-safe, so only the main thread may call it
+static int no_ydb_in_worker(lua_State *L) {
+  return luaL_error(L, "YDB may not be called from a worker thread");
+}
+
+// Open and initialize a worker thread's lua_State with the default libraries, stopping its Lua code from loading YDB
+// and running the text in environment variable MLUA_WORKER_INIT (or the file it names with @file)
+// Lua C function so that it can be called with protected pcall
+static int init_worker_state(lua_State *L) {
+  luaL_openlibs(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  lua_getfield(L, -1, LUA_LOADLIBNAME);
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, no_ydb_in_worker);
+  lua_setfield(L, -2, "yottadb");
+  lua_pushcfunction(L, no_ydb_in_worker);
+  lua_setfield(L, -2, "_yottadb");
+  lua_pushcfunction(L, no_ydb_in_worker);
+  lua_setfield(L, -2, "mlua");
+  lua_pop(L, 3);
+  char *init = getenv("MLUA_WORKER_INIT");
+  if (init && *init) {
+    if (init[0] == '@' ? luaL_loadfile(L, init+1) : luaL_loadbuffer(L, init, strlen(init), init))
+      lua_error(L);
+    lua_call(L, 0, 0);
+  }
+  return 0;
+}
+
+// Lua count hook of every worker lua_State that aborts the running job with a Lua error once mlua_cancel() has cancelled it
+// Under LuaJIT, as for budgets, code that the JIT has compiled is not interrupted
+static void worker_hook(lua_State *L, lua_Debug *ar) {
+  if (Worker_job && atomic_load_explicit(&Worker_job->cancelled, memory_order_relaxed))
+    luaL_error(L, "MLua: job was cancelled");  // raised again at the next check if Lua code catches it with pcall()
+}
+
+// Worker thread helper like push_code(): push the function named by a '>' code string or else compile the code
+// return 0 and the function on top of the Lua stack, or nonzero with the error message on top of the Lua stack
+static int push_job_code(lua_State *L, const char *code, size_t length) {
+  if (!length || code[0] != '>')
+    return luaL_loadbuffer(L, code, length, "mlua(code)");
+  lua_pushglobaltable(L);
+  const char *name = code+1, *end;
+  do {
+    end = memchr(name, '.', code+length-name);
+    lua_pushlstring(L, name, (end? end: code+length) - name);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);  // drop lookup table
+    name = end+1;
+  } while (end && lua_type(L, -1) == LUA_TTABLE);
+  int type = lua_type(L, -1);
+  if (type == LUA_TFUNCTION)
+    return 0;
+  lua_pop(L, 1);
+  if (type == LUA_TNIL)
+    lua_pushfstring(L, "could not find function '%s'", code+1);
+  else
+    lua_pushfstring(L, "tried to invoke '%s' as a function but it is of type: %s", code+1, lua_typename(L, type));
+  return 1;
+}
+
+// Append a record of `length` bytes of data (or a nil record if length is SIZE_MAX) to a batch buffer
+// return false if memory could not be allocated
+static bool append_record(input_buffer_t *buffer, const char *data, size_t length) {
+  return !write_buffer(NULL, &length, sizeof(length), buffer) && (length == SIZE_MAX || !write_buffer(NULL, data, length, buffer));
+}
+
+// Return the next record in a batch buffer, and its length in *length, advancing *p past it
+static const char *next_record(const char **p, size_t *length) {
+  memcpy(length, *p, sizeof(*length));
+  *p += sizeof(*length);
+  const char *data = *p;
+  if (*length != SIZE_MAX)
+    *p += *length;
+  return data;
+}
+
+// Run a batch job for mlua_pmap() by applying the function on top of the Lua stack to each node's value and subscript
+// return 0 with the batch output filled in, or nonzero with the error message on top of the Lua stack
+static int run_batch(lua_State *L, allocator_t *allocator, batch_t *batch) {
+  const char *in = batch->input.data;
+  for (int i=0; i<batch->nodes; i++) {
+    size_t value_length, sub_length;
+    const char *value = next_record(&in, &value_length);
+    const char *sub = next_record(&in, &sub_length);
+    lua_pushvalue(L, -1);  // copy of fn
+    lua_pushlstring(L, value, value_length);
+    lua_pushlstring(L, sub, sub_length);
+    if (limited_pcall(L, allocator, 2, 1))
+      return 1;
+    bool ok;
+    if (lua_isnil(L, -1))
+      ok = append_record(&batch->output, NULL, SIZE_MAX);
+    else {
+      size_t length;
+      const char *result = push_m_string(L, -1, &length);
+      ok = append_record(&batch->output, result, length);
+      lua_pop(L, 1);  // pop result string
+    }
+    lua_pop(L, 1);  // pop result
+    if (!ok) {
+      lua_pushliteral(L, "could not allocate memory for results");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Run job in worker lua_State L, whose memory allocator is `allocator` (or NULL if Lua could not use it),
+// and store its result or error message in the job, formatted as mlua_lua() would return it
+// L is NULL if the worker could not open its lua_State, in which case init_error explains why
+static void run_job(lua_State *L, allocator_t *allocator, job_t *job, const char *init_error) {
+  const char *result = init_error;
+  size_t length = strlen(init_error);
+  int error = !L;
+  if (L) {
+    error = push_job_code(L, job->code, job->code_length);
+    if (!error && job->batch)
+      error = run_batch(L, allocator, job->batch);
+    else if (!error) {
+      for (int i=0; i<job->args; i++)
+        lua_pushlstring(L, job->arg[i], job->arg_length[i]);
+      error = limited_pcall(L, allocator, job->args, 1);
+    }
+    if (error) {
+      lua_pushfstring(L, "Lua: %s", lua_isstring(L, -1)? lua_tostring(L, -1): "(error object is not a string)");
+      result = lua_tolstring(L, -1, &length);
+    } else if (job->batch)
+      result = "", length = 0;
+    else
+      result = push_m_string(L, -1, &length);
+  }
+  job->result = malloc(length+1);  // +1 so that malloc never has to allocate zero bytes
+  if (job->result)
+    memcpy(job->result, result, length);
+  job->result_length = job->result? length: 0;
+  job->failed = error || !job->result;
+  if (L)
+    lua_settop(L, 0);
+}
+
+static void free_job(job_t *job);  // defined below with mlua_submit()
+
+// Body of each worker thread: take jobs from the queue and run them in the worker's own lua_State, forever
+static void *worker_thread(void *unused) {
+  char init_error[256] = "MLua: worker thread could not allocate a lua_State";
+  char *limit_string = getenv("MLUA_WORKER_MEMORY");
+  size_t limit = limit_string && *limit_string? strtoull(limit_string, NULL, 0): 0;
+  allocator_t *allocator = calloc(1, sizeof(allocator_t));
+  lua_State *L = NULL;
+  if (allocator) {
+    allocator->limit = limit;
+    L = lua_newstate(mlua_alloc, allocator);
+    if (!L) {
+      // as in mlua_open(), fall back to the default allocator if Lua refuses ours, but only if there is no limit to enforce
+      free_allocator(allocator);
+      allocator = NULL;
+      if (limit)
+        snprintf(init_error, sizeof(init_error), "MLua: worker thread could not allocate a lua_State within MLUA_WORKER_MEMORY, or this Lua implementation does not support memory limits");
+      else
+        L = luaL_newstate();
+    }
+  }
+  if (L) {
+    lua_atpanic(L, mlua_panic);
+    lua_pushcfunction(L, init_worker_state);
+    if (limited_pcall(L, allocator, 0, 0)) {
+      snprintf(init_error, sizeof(init_error), "MLua: in worker thread init, %s", lua_tostring(L, -1));
+      lua_close(L);
+      L = NULL;
+    } else
+      lua_sethook(L, worker_hook, LUA_MASKCOUNT, BUDGET_INTERVAL);
+  }
+  pthread_mutex_lock(&Jobs_lock);
+  while (true) {
+    while (!Queue_head)
+      pthread_cond_wait(&Job_queued, &Jobs_lock);
+    job_t *job = Queue_head;
+    Queue_head = job->next;
+    if (!Queue_head)
+      Queue_tail = NULL;
+    job->status = JOB_RUNNING;
+    Worker_job = job;
+    pthread_mutex_unlock(&Jobs_lock);
+    run_job(L, allocator, job, init_error);
+    pthread_mutex_lock(&Jobs_lock);
+    Worker_job = NULL;
+    job->status = JOB_DONE;
+    if (atomic_load(&job->cancelled))
+      free_job(job);  // no one will collect it
+    else
+      pthread_cond_broadcast(&Job_done);
+  }
+  return NULL;
+}
+
+// If we are a forked child, forget our parent's worker threads and jobs, which do not exist here
+// Jobs_lock may also have been copied while one of those threads held it, so initialize it afresh
+static void forget_parent_workers(void) {
+  if (!Workers_pid || Workers_pid == getpid())
+    return;
+  pthread_mutex_init(&Jobs_lock, NULL);
+  pthread_cond_init(&Job_queued, NULL);
+  pthread_cond_init(&Job_done, NULL);
+  Workers = 0, Workers_pid = 0;
+  Jobs = NULL, Jobs_size = 0;
+  Queue_head = Queue_tail = NULL;
+}
+
+// mlua_submit() helper to start the worker threads if not yet started: as many as environment variable MLUA_WORKERS,
+// or else as many as there are CPUs online, but at least `minimum`
+// The workers block all signals so that YDB's signal handlers run only in the main thread
+// Must be called while holding Jobs_lock; return the number of workers running
+static int start_workers(int minimum) {
+  if (Workers && Workers >= minimum)
+    return Workers;
+  char *workers_string = getenv("MLUA_WORKERS");
+  long workers = workers_string && *workers_string? atol(workers_string): sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers < minimum) workers = minimum;
+  if (workers < 1) workers = 1;
+  sigset_t all, oldmask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &oldmask);
+  for (; Workers<workers; Workers++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_thread, NULL))
+      break;
+    pthread_detach(thread);
+  }
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  Workers_pid = getpid();
+  return Workers;
+}
+
+// mlua_submit() helper to free a job
+static void free_job(job_t *job) {
+  free(job->code);
+  for (int i=0; i<job->args; i++)
+    free(job->arg[i]);
+  if (job->batch)
+    free(job->batch->input.data), free(job->batch->output.data), free(job->batch);
+  free(job->result);
+  free(job);
+}
+
+// Add job to the queue for the worker threads; must be called while holding Jobs_lock
+static void queue_job(job_t *job) {
+  job->status = JOB_QUEUED;
+  if (Queue_tail)
+    Queue_tail->next = job;
+  else
+    Queue_head = job;
+  Queue_tail = job;
+  pthread_cond_signal(&Job_queued);
+}
+
+// Submit code (or a '>' function name, as for mlua_lua()) with up to 8 string arguments to run in a worker thread
+// so that M can continue with other work. Each worker thread has its own lua_State which may not call YDB
+// The job and its result are kept until mlua_wait() collects it or mlua_cancel() cancels it, so M must do one or the other
+// return a job id >0 whose result may be collected with mlua_wait(), or MLUA_ERROR with the error message in output
+gtm_long_t mlua_submit(int argc, const gtm_string_t *code, gtm_string_t *output, ...) {
+  if (argc<2 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<1)
+    return outputf(output, output_size, "MLua: no code supplied to mlua_submit()"), MLUA_ERROR;
+  int args = argc-2<0? 0: argc-2;
+  if (args > MAX_JOB_ARGS)
+    return outputf(output, output_size, "MLua: too many arguments supplied to mlua_submit()"), MLUA_ERROR;
+  job_t *job = calloc(1, sizeof(job_t));
+  bool ok = job && (job->code = malloc(code->length+1));
+  if (ok) {
+    memcpy(job->code, code->address, code->length);
+    job->code[code->length] = '\0';
+    job->code_length = code->length;
+  }
+  va_list argp;
+  va_start(argp, output);
+  for (; ok && job->args<args; job->args++) {
+    gtm_string_t *arg = va_arg(argp, gtm_string_t *);
+    job->arg[job->args] = malloc(arg->length+1);  // +1 so that malloc never has to allocate zero bytes
+    ok = job->arg[job->args] != NULL;
+    if (ok)
+      memcpy(job->arg[job->args], arg->address, arg->length), job->arg_length[job->args] = arg->length;
+  }
+  va_end(argp);
+  if (!ok) {
+    if (job) free_job(job);
+    return outputf(output, output_size, "MLua: could not allocate memory for job"), MLUA_ERROR;
+  }
+
+  forget_parent_workers();
+  pthread_mutex_lock(&Jobs_lock);
+  if (!start_workers(1)) {
+    pthread_mutex_unlock(&Jobs_lock);
+    free_job(job);
+    return outputf(output, output_size, "MLua: could not start worker threads"), MLUA_ERROR;
+  }
+  // find a free job id, allocating more if necessary
+  gtm_long_t id;
+  for (id=1; id<=Jobs_size && Jobs[id-1]; id++);
+  if (id > Jobs_size) {
+    job_t **jobs = realloc(Jobs, (Jobs_size+JOB_ARRAY_LUMPS) * sizeof(job_t *));
+    if (!jobs) {
+      pthread_mutex_unlock(&Jobs_lock);
+      free_job(job);
+      return outputf(output, output_size, "MLua: could not allocate memory for job"), MLUA_ERROR;
+    }
+    memset(jobs+Jobs_size, 0, JOB_ARRAY_LUMPS * sizeof(job_t *));
+    Jobs = jobs;
+    Jobs_size += JOB_ARRAY_LUMPS;
+  }
+  Jobs[id-1] = job;
+  queue_job(job);
+  pthread_mutex_unlock(&Jobs_lock);
+  return id;
+}
+
+// Wait up to `timeout` milliseconds (forever if negative or not supplied) for job job_id from mlua_submit() to finish
+// On completion return 0 with the job's result in output, or MLUA_ERROR with its error message, and release the job id
+// return MLUA_TIMEOUT if the job has not finished (the job id remains valid), or MLUA_ERROR if job_id is invalid
+gtm_int_t mlua_wait(int argc, gtm_long_t job_id, gtm_string_t *output, gtm_long_t timeout) {
+  if (argc<2 || !output || !output->address) output=NULL;
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<3) timeout=-1;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  if (timeout > 0) {
+    deadline.tv_sec += timeout/1000;
+    deadline.tv_nsec += timeout%1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+      deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+  }
+  forget_parent_workers();
+  pthread_mutex_lock(&Jobs_lock);
+  if (argc<1 || job_id<1 || job_id>Jobs_size || !Jobs[job_id-1]) {
+    pthread_mutex_unlock(&Jobs_lock);
+    return outputf(output, output_size, "MLua: supplied job (%ld) is invalid", (long)job_id), MLUA_ERROR;
+  }
+  job_t *job = Jobs[job_id-1];
+  while (job->status != JOB_DONE && timeout) {
+    if (timeout < 0)
+      pthread_cond_wait(&Job_done, &Jobs_lock);
+    else if (pthread_cond_timedwait(&Job_done, &Jobs_lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  if (job->status != JOB_DONE) {
+    pthread_mutex_unlock(&Jobs_lock);
+    if (output) output->length = 0;
+    return MLUA_TIMEOUT;
+  }
+  Jobs[job_id-1] = NULL;
+  pthread_mutex_unlock(&Jobs_lock);
+  if (output) {
+    size_t length = job->result_length > output_size? output_size: job->result_length;
+    memcpy(output->address, job->result, length);
+    output->length = length;
+  }
+  gtm_int_t status = job->failed? MLUA_ERROR: 0;
+  free_job(job);
+  return status;
+}
+
+// Cancel job job_id from mlua_submit() and release the job id, discarding any result
+// A job still in the queue is removed from it; a running job is aborted with a Lua error at its worker's next hook check
+// This is the way out for M when a job runs too long: mlua_wait() with a timeout and then mlua_cancel()
+// return 0 on success or MLUA_ERROR if job_id is invalid
+gtm_int_t mlua_cancel(int argc, gtm_long_t job_id) {
+  forget_parent_workers();
+  pthread_mutex_lock(&Jobs_lock);
+  if (argc<1 || job_id<1 || job_id>Jobs_size || !Jobs[job_id-1]) {
+    pthread_mutex_unlock(&Jobs_lock);
+    return MLUA_ERROR;
+  }
+  job_t *job = Jobs[job_id-1];
+  Jobs[job_id-1] = NULL;
+  if (job->status == JOB_QUEUED) {
+    job_t **link = &Queue_head, *previous = NULL;
+    while (*link != job)
+      previous = *link, link = &(*link)->next;
+    *link = job->next;
+    if (Queue_tail == job)
+      Queue_tail = previous;
+    free_job(job);
+  } else if (job->status == JOB_DONE)
+    free_job(job);
+  else
+    atomic_store(&job->cancelled, true);  // the worker frees it when it stops
+  pthread_mutex_unlock(&Jobs_lock);
+  return 0;
+}
+
+// Return 1 if job job_id from mlua_submit() has finished so that mlua_wait() will not block, 0 if it has not,
+// or MLUA_ERROR if job_id is invalid
+gtm_int_t mlua_poll(int argc, gtm_long_t job_id) {
+  forget_parent_workers();
+  pthread_mutex_lock(&Jobs_lock);
+  gtm_int_t status = MLUA_ERROR;
+  if (argc>=1 && job_id>=1 && job_id<=Jobs_size && Jobs[job_id-1])
+    status = Jobs[job_id-1]->status == JOB_DONE;
+  pthread_mutex_unlock(&Jobs_lock);
+  return status;
+}
+
+#define PMAP_BATCH_NODES 256 /* maximum number of nodes mlua_pmap() sends to a worker thread in one job */
+#define PMAP_BATCH_BYTES 1048576 /* ... or until the batch holds about this many bytes of values */
+#define PMAP_MAX_THREADS 256 /* maximum number of worker threads mlua_pmap() can use at once */
+
+// mlua_pmap() helper to wait for batch job to finish and then, if `write` is true, write its results to M variable `out`
+// in the order of the nodes, then free the job
+// return the number of nodes written, or MLUA_ERROR with the error message in output
+static gtm_long_t finish_batch(job_t *job, bool write, glvn_t *out, gtm_string_t *output, int output_size) {
+  pthread_mutex_lock(&Jobs_lock);
+  while (job->status != JOB_DONE)
+    pthread_cond_wait(&Job_done, &Jobs_lock);
+  pthread_mutex_unlock(&Jobs_lock);
+  gtm_long_t count = 0;
+  if (write && job->failed) {
+    outputf(output, output_size, "%.*s", (int)job->result_length, job->result);
+    count = MLUA_ERROR;
+  }
+  const char *in = job->batch->input.data, *results = job->batch->output.data;
+  for (int i=0; write && count>=0 && i<job->batch->nodes; i++) {
+    size_t value_length, sub_length, length;
+    next_record(&in, &value_length);
+    const char *sub = next_record(&in, &sub_length);
+    const char *result = next_record(&results, &length);
+    if (length != SIZE_MAX) {
+      ydb_buffer_t value = {length, length, (char*)result};
+      out->subs[out->subs_used] = (ydb_buffer_t){sub_length, sub_length, (char*)sub};
+      int status = ydb_set_s(&out->varname, out->subs_used+1, out->subs, &value);
+      if (status != YDB_OK) {
+        ydb_error_output(output, output_size, status);
+        count = MLUA_ERROR;
+        break;
+      }
+    }
+    count++;
+  }
+  free_job(job);
+  return count;
+}
+
+// Like mlua_map(), but apply Lua function fn to the child nodes of input_glvn in `threads` worker threads at once
+// (0 or missing for as many as mlua_submit() starts), using more than one core for data-parallel work
+// The calling thread reads the nodes from YDB in batches for the workers and writes their results, in order, to output_glvn
+// As for mlua_submit(), fn runs in the workers' own lua_States, which may not call YDB
+// return the number of nodes processed, or MLUA_ERROR with the error message in .output (if supplied) or on stdout
+gtm_long_t mlua_pmap(int argc, const gtm_string_t *fn, const gtm_string_t *input_glvn, const gtm_string_t *output_glvn, gtm_string_t *output, gtm_long_t threads) {
+  if (argc<3) return MLUA_ERROR;
+  if (argc<4 || !output || !output->address) output=NULL; // don't return error string
+  int output_size = output? output->length: 0; // ydb sets it to preallocated size
+  if (argc<5 || threads<0) threads=0;
+  if (threads > PMAP_MAX_THREADS) threads = PMAP_MAX_THREADS;
+
+  glvn_t in, out;
+  const char *syntax_error = parse_glvn(input_glvn->address, input_glvn->length, &in);
+  if (syntax_error)
+    return outputf(output, output_size, "MLua: input variable %s", syntax_error), MLUA_ERROR;
+  syntax_error = parse_glvn(output_glvn->address, output_glvn->length, &out);
+  if (syntax_error) {
+    free(in.storage);
+    return outputf(output, output_size, "MLua: output variable %s", syntax_error), MLUA_ERROR;
+  }
+  gtm_long_t count = MLUA_ERROR;
+  ydb_buffer_t sub={0, 0, NULL}, next={0, 0, NULL}, value={0, 0, NULL};
+  if (in.subs_used >= YDB_MAX_SUBS || out.subs_used >= YDB_MAX_SUBS) {
+    outputf(output, output_size, "MLua: variable already has the maximum of %d subscripts", YDB_MAX_SUBS);
+    goto cleanup;
+  }
+  if (!grow_buffer(&sub, 1024) || !grow_buffer(&next, 1024) || !grow_buffer(&value, 65536)) {
+    outputf(output, output_size, "MLua: could not allocate memory");
+    goto cleanup;
+  }
+  forget_parent_workers();
+  pthread_mutex_lock(&Jobs_lock);
+  int workers = start_workers(threads);
+  pthread_mutex_unlock(&Jobs_lock);
+  if (!workers) {
+    outputf(output, output_size, "MLua: could not start worker threads");
+    goto cleanup;
+  }
+  if (!threads)
+    threads = workers > PMAP_MAX_THREADS? PMAP_MAX_THREADS: workers;
+
+  // batches in flight form a ring of up to `threads` jobs, oldest first, so that results are written in node order
+  job_t *inflight[PMAP_MAX_THREADS], *job = NULL;
+  int first = 0, used = 0;
+  count = 0;
+  int n = in.subs_used, status;
+  in.subs[n] = sub;  // start from subscript ""
+  in.subs[n].len_used = 0;
+  bool more = true;
+  while (more || job) {
+    status = YDB_ERR_NODEEND;
+    if (more)
+      status = ydb_subscript_next_s(&in.varname, n, in.subs, &next);
+    if (status == YDB_ERR_INVSTRLEN) {
+      if (!grow_buffer(&next, next.len_used)) goto nomemory;
+      continue;
+    }
+    if (status == YDB_OK) {
+      // swap buffers so that `next` becomes the current subscript
+      sub = next, next = in.subs[n], in.subs[n] = sub;
+      status = ydb_get_s(&in.varname, n+1, in.subs, &value);
+      if (status == YDB_ERR_INVSTRLEN) {
+        if (!grow_buffer(&value, value.len_used)) goto nomemory;
+        status = ydb_get_s(&in.varname, n+1, in.subs, &value);
+      }
+      if (status == YDB_ERR_LVUNDEF || status == YDB_ERR_GVUNDEF)
+        continue;  // node has children but no value
+      if (status != YDB_OK) goto ydberror;
+      if (!job) {
+        job = calloc(1, sizeof(job_t));
+        if (job && !(job->batch = calloc(1, sizeof(batch_t)))) free(job), job=NULL;
+        if (job && (job->code = malloc(fn->length+1))) {
+          memcpy(job->code, fn->address, fn->length);
+          job->code[fn->length] = '\0';
+          job->code_length = fn->length;
+        } else if (job) {
+          free_job(job), job=NULL;
+        }
+        if (!job) goto nomemory;
+      }
+      if (!append_record(&job->batch->input, value.buf_addr, value.len_used) || !append_record(&job->batch->input, sub.buf_addr, sub.len_used))
+        goto nomemory;
+      job->batch->nodes++;
+      if (job->batch->nodes < PMAP_BATCH_NODES && job->batch->input.length < PMAP_BATCH_BYTES)
+        continue;
+    } else if (status == YDB_ERR_NODEEND)
+      more = false;
+    else
+      goto ydberror;
+    if (!job)
+      break;
+    // send the full (or last) batch to the workers, first writing the results of the oldest batch if all threads are busy
+    if (used == threads) {
+      gtm_long_t written = finish_batch(inflight[first], true, &out, output, output_size);
+      first = (first+1) % threads, used--;
+      if (written < 0) {
+        count = MLUA_ERROR;
+        free_job(job), job = NULL;
+        break;
+      }
+      count += written;
+    }
+    inflight[(first+used) % threads] = job, used++;
+    pthread_mutex_lock(&Jobs_lock);
+    queue_job(job);
+    pthread_mutex_unlock(&Jobs_lock);
+    job = NULL;
+    continue;
+  nomemory:
+    outputf(output, output_size, "MLua: could not allocate memory");
+    count = MLUA_ERROR;
+    break;
+  ydberror:
+    ydb_error_output(output, output_size, status);
+    count = MLUA_ERROR;
+    break;
+  }
+  if (job)
+    free_job(job);
+  // write the results of the remaining batches in order; after any error just wait for them, since workers are using them
+  for (; used; first = (first+1) % threads, used--) {
+    gtm_long_t written = finish_batch(inflight[first], count >= 0, &out, output, output_size);
+    count = written < 0? MLUA_ERROR: count<0? count: count+written;
+  }
+  if (count >= 0 && output) output->length = 0;
+  sub = in.subs[n];  // in case buffers were swapped
+cleanup:
+  free(sub.buf_addr), free(next.buf_addr), free(value.buf_addr);
+  free(in.storage), free(out.storage);
+  return count;
+}
+
+
+// ~~~ Lua module 'mlua' that gives Lua code running in MLua fast bulk access to YDB: require'mlua'
+
+#define ITERATOR_BATCH 256 /* default number of nodes that traversal iterators prefetch from YDB at once */
+#define ITERATOR_METATABLE "mlua.iterator"
+
+// define the state of a traversal iterator returned by mlua.children() or mlua.nodes(), kept in a Lua full userdata
+// Nodes are prefetched from YDB in batches into `fetched`, whose memory (like that of the subscript buffers) is reused for every batch
+typedef struct iterator_t {
+  glvn_t glvn;  // root of the traversal; glvn.storage is NULL once the iterator has been freed
+  bool nodes;  // true to traverse every descendant node with ydb_node_next_s(); false to traverse only children
+  bool started;  // the first batch has been fetched
+  bool done;  // YDB has no more nodes to fetch
+  lua_Integer batch;  // number of nodes to prefetch at once
+  int current, subs_used;  // which of subs[] holds the last node fetched, and how many subscripts it uses
+  ydb_buffer_t subs[2][YDB_MAX_SUBS];  // last node fetched (where the next fetch continues from) and the node after it
+  ydb_buffer_t value;
+  input_buffer_t fetched;  // records of prefetched nodes
+  size_t position;  // offset in fetched of the next record to return
+} iterator_t;
+
+// Raise a Lua error with the message for YDB error status
+static int ydb_error(lua_State *L, int status) {
+  char message[YDB_MAX_ERRORMSG];
+  ydb_zstatus(message, sizeof(message));
+  return luaL_error(L, "MLua: YDB error %d: %s", status, message);
+}
+
+// Append the node of iterator `it` that was fetched last to it->fetched as a record of its value (nil if it has none)
+// followed by its subscript (children) or by a count of its subscripts below the root and then those subscripts (nodes)
+// return YDB_OK on success; otherwise a YDB error status, or YDB_ERR_INVSTRLEN if memory could not be allocated
+static int fetch_value(iterator_t *it) {
+  int n = it->glvn.subs_used;
+  ydb_buffer_t *node = it->subs[it->current];
+  int status = ydb_get_s(&it->glvn.varname, it->subs_used, node, &it->value);
+  if (status == YDB_ERR_INVSTRLEN) {
+    if (!grow_buffer(&it->value, it->value.len_used)) return YDB_ERR_INVSTRLEN;
+    status = ydb_get_s(&it->glvn.varname, it->subs_used, node, &it->value);
+  }
+  bool has_value = status == YDB_OK;
+  if (!has_value && status != YDB_ERR_LVUNDEF && status != YDB_ERR_GVUNDEF) return status;
+  if (!has_value && it->nodes) return YDB_OK;  // only the root node can lack a value, and it is then skipped
+  if (!append_record(&it->fetched, it->value.buf_addr, has_value? it->value.len_used: SIZE_MAX))
+    return YDB_ERR_INVSTRLEN;
+  if (it->nodes) {
+    size_t count = it->subs_used - n;
+    if (write_buffer(NULL, &count, sizeof(count), &it->fetched)) return YDB_ERR_INVSTRLEN;
+    for (int j=n; j<it->subs_used; j++)
+      if (!append_record(&it->fetched, node[j].buf_addr, node[j].len_used)) return YDB_ERR_INVSTRLEN;
+  } else if (!append_record(&it->fetched, node[n].buf_addr, node[n].len_used))
+    return YDB_ERR_INVSTRLEN;
+  return YDB_OK;
+}
+
+// Fetch the next batch of nodes for iterator `it` into it->fetched
+// return YDB_OK on success; otherwise a YDB error status, or YDB_ERR_INVSTRLEN if memory could not be allocated
+static int fetch_nodes(iterator_t *it) {
+  int n = it->glvn.subs_used, status = YDB_OK;
+  it->fetched.length = it->position = 0;
+  if (!it->started) {
+    it->started = true;
+    if (it->nodes && (status = fetch_value(it)) != YDB_OK)
+      return status;  // mlua.nodes() starts with the root node itself
+  }
+  for (lua_Integer i=it->fetched.length? 1: 0; i<it->batch; i++) {
+    ydb_buffer_t *subs = it->subs[it->current], *next = it->subs[!it->current];
+    int next_used = n+1;
+    do {
+      if (it->nodes) {
+        next_used = YDB_MAX_SUBS;
+        status = ydb_node_next_s(&it->glvn.varname, it->subs_used, subs, &next_used, next);
+      } else
+        status = ydb_subscript_next_s(&it->glvn.varname, n+1, subs, &next[n]);
+      int grow = it->nodes? next_used: n;
+      if (status == YDB_ERR_INVSTRLEN && !grow_buffer(&next[grow], next[grow].len_used)) return YDB_ERR_INVSTRLEN;
+    } while (status == YDB_ERR_INVSTRLEN);
+    if (status == YDB_ERR_NODEEND) {
+      it->done = true;
+      return YDB_OK;
+    }
+    if (status != YDB_OK) return status;
+    if (it->nodes) {
+      // stop once the next node is outside the root's subtree
+      bool inside = next_used > n;
+      for (int j=0; inside && j<n; j++)
+        inside = next[j].len_used == subs[j].len_used && !memcmp(next[j].buf_addr, subs[j].buf_addr, subs[j].len_used);
+      if (!inside) {
+        it->done = true;
+        return YDB_OK;
+      }
+      it->current = !it->current, it->subs_used = next_used;
+    } else {
+      // only the last subscript changes, so swap it into place
+      ydb_buffer_t sub = subs[n];
+      subs[n] = next[n], next[n] = sub;
+    }
+    status = fetch_value(it);
+    if (status != YDB_OK) return status;
+  }
+  return YDB_OK;
+}
+
+// Lua iterator function (a closure over its iterator_t userdata) that returns the next prefetched node as plain strings:
+// subscript, value for mlua.children(); value, subscript1, subscript2, ... for mlua.nodes()
+static int iterate(lua_State *L) {
+  iterator_t *it = lua_touserdata(L, lua_upvalueindex(1));
+  if (it->position >= it->fetched.length) {
+    if (it->done || !it->glvn.storage)
+      return 0;
+    int status = fetch_nodes(it);
+    if (status == YDB_ERR_INVSTRLEN)
+      return luaL_error(L, "MLua: could not allocate memory");
+    if (status != YDB_OK)
+      return ydb_error(L, status);
+    if (!it->fetched.length)
+      return 0;
+  }
+  const char *p = it->fetched.data + it->position;
+  size_t length;
+  const char *value = next_record(&p, &length);
+  int results;
+  if (it->nodes) {
+    size_t count;
+    memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+    luaL_checkstack(L, count+1, "too many subscripts");
+    lua_pushlstring(L, value, length);
+    for (size_t j=0; j<count; j++) {
+      const char *sub = next_record(&p, &length);
+      lua_pushlstring(L, sub, length);
+    }
+    results = count+1;
+  } else {
+    size_t sub_length;
+    const char *sub = next_record(&p, &sub_length);
+    lua_pushlstring(L, sub, sub_length);
+    if (length == SIZE_MAX) lua_pushnil(L);
+    else lua_pushlstring(L, value, length);
+    results = 2;
+  }
+  it->position = p - it->fetched.data;
+  return results;
+}
+
+// __gc metamethod of iterator_t userdata that frees its buffers
+static int free_iterator(lua_State *L) {
+  iterator_t *it = luaL_checkudata(L, 1, ITERATOR_METATABLE);
+  if (!it->glvn.storage)
+    return 0;
+  for (int i=0; i<YDB_MAX_SUBS; i++)
+    free(it->subs[0][i].buf_addr), free(it->subs[1][i].buf_addr);
+  free(it->value.buf_addr);
+  free(it->fetched.data);
+  free(it->glvn.storage);
+  it->glvn.storage = NULL;
+  return 0;
+}
+
+// Push an iterator over the YDB variable named by the first parameter (e.g. '^BCAT("lvd")'), fetching `batch` nodes at a time
+// (optional second parameter)
+static int push_iterator(lua_State *L, bool nodes) {
+  size_t len;
+  const char *name = luaL_checklstring(L, 1, &len);
+  lua_Integer batch = luaL_optinteger(L, 2, ITERATOR_BATCH);
+  luaL_argcheck(L, batch > 0, 2, "batch size must be positive");
+  iterator_t *it = lua_newuserdata(L, sizeof(iterator_t));
+  memset(it, 0, sizeof(iterator_t));
+  const char *syntax_error = parse_glvn(name, len, &it->glvn);
+  if (syntax_error)
+    return luaL_error(L, "MLua: variable %s", syntax_error);
+  luaL_setmetatable(L, ITERATOR_METATABLE);
+  it->nodes = nodes;
+  it->batch = batch;
+  // start from the root node, or from its first child
+  int n = it->glvn.subs_used;
+  if (!nodes && n >= YDB_MAX_SUBS)
+    return luaL_error(L, "MLua: variable already has the maximum of %d subscripts", YDB_MAX_SUBS);
+  for (int i=0; i<n; i++)
+    if (!grow_buffer(&it->subs[0][i], it->glvn.subs[i].len_used) || !grow_buffer(&it->subs[1][i], it->glvn.subs[i].len_used))
+      return luaL_error(L, "MLua: could not allocate memory");
+    else {
+      memcpy(it->subs[0][i].buf_addr, it->glvn.subs[i].buf_addr, it->glvn.subs[i].len_used);
+      memcpy(it->subs[1][i].buf_addr, it->glvn.subs[i].buf_addr, it->glvn.subs[i].len_used);
+      it->subs[0][i].len_used = it->subs[1][i].len_used = it->glvn.subs[i].len_used;
+    }
+  it->subs_used = n + !nodes;  // subs[0][n] is empty to start traversing children from subscript ""
+  lua_pushcclosure(L, iterate, 1);
+  return 1;
+}
+
+// mlua.children(glvn[, batch]) returns an iterator over the child subscripts of YDB variable glvn in collation order,
+// like an M $ORDER loop: for subscript, value in mlua.children('^BCAT("lvd")') do ... end
+// value is nil for a child that has descendants but no value
+// Nodes are prefetched in batches of `batch` (default 256), so the iteration may not see changes to nodes already fetched
+static int mlua_children(lua_State *L) {
+  return push_iterator(L, false);
+}
+
+// mlua.nodes(glvn[, batch]) returns an iterator over glvn and all its descendant nodes that have values, depth first,
+// like an M $QUERY loop: for value, subscript1, subscript2, ... in mlua.nodes('^tree') do ... end
+// Subscripts are those below glvn's own; nodes are prefetched in batches like mlua.children()
+static int mlua_nodes(lua_State *L) {
+  return push_iterator(L, true);
+}
+
+// Append the variable named by Lua value at `index` to Updates.record: either an M variable reference string like
+// '^oak(1,"height")' or a table of the variable name followed by its subscripts like {'^oak',1,'height'}
+// Raise a Lua error if it is invalid
+static void append_glvn(lua_State *L, int index) {
+  input_buffer_t *record = &Updates.record;
+  bool ok = true;
+  size_t count;
+  if (lua_type(L, index) == LUA_TTABLE) {
+    count = lua_rawlen(L, index);
+    luaL_argcheck(L, count >= 1 && count <= YDB_MAX_SUBS+1, index, "table must hold a variable name and up to 31 subscripts");
+    for (size_t i=1; ok && i<=count; i++) {
+      lua_rawgeti(L, index, i);
+      size_t len;
+      const char *s = push_m_string(L, -1, &len);
+      ok = append_record(record, s, len);
+      if (i == 1) {
+        size_t subs = count-1;
+        ok = ok && !write_buffer(NULL, &subs, sizeof(subs), record);
+      }
+      lua_pop(L, 2);  // pop string and table element
+    }
+  } else {
+    size_t len;
+    const char *name = luaL_checklstring(L, index, &len);
+    glvn_t glvn;
+    const char *syntax_error = parse_glvn(name, len, &glvn);
+    if (syntax_error)
+      luaL_error(L, "MLua: variable %s", syntax_error);
+    count = glvn.subs_used;
+    ok = append_record(record, glvn.varname.buf_addr, glvn.varname.len_used) && !write_buffer(NULL, &count, sizeof(count), record);
+    for (size_t i=0; ok && i<count; i++)
+      ok = append_record(record, glvn.subs[i].buf_addr, glvn.subs[i].len_used);
+    free(glvn.storage);
+  }
+  if (!ok)
+    luaL_error(L, "MLua: could not allocate memory");
+}
+
+// Buffer the update that Lua function mlua.set() or mlua.kill() (selected by `type` 'S' or 'K') was called with
+static int buffer_update(lua_State *L, char type) {
+  Updates.record.length = 0;
+  if (write_buffer(NULL, &type, 1, &Updates.record))
+    return luaL_error(L, "MLua: could not allocate memory");
+  append_glvn(L, 1);
+  if (type == 'S') {
+    luaL_checkany(L, 2);
+    size_t len;
+    const char *value = push_m_string(L, 2, &len);
+    if (!append_record(&Updates.record, value, len))
+      return luaL_error(L, "MLua: could not allocate memory");
+  }
+  if (write_buffer(NULL, Updates.record.data, Updates.record.length, &Updates.buffer))
+    return luaL_error(L, "MLua: could not allocate memory");
+  Updates.count++;
+  return 0;
+}
+
+// mlua.set(glvn, value) buffers an update that sets YDB variable glvn (see append_glvn()) to value
+// Updates made by mlua.set() and mlua.kill() are not visible to YDB until they are flushed (see mlua.flush())
+static int mlua_set(lua_State *L) {
+  return buffer_update(L, 'S');
+}
+
+// mlua.kill(glvn) buffers an update that kills YDB variable glvn (see append_glvn()) and all its descendants
+static int mlua_kill(lua_State *L) {
+  return buffer_update(L, 'K');
+}
+
+// ydb_tp_s() callback that applies every buffered update; *tries counts invocations so that restarts can be counted
+static int apply_updates(void *tries) {
+  if ((*(int*)tries)++)
+    Updates.restarts++;
+  const char *p = Updates.buffer.data, *end = p + Updates.buffer.length;
+  ydb_buffer_t varname, subs[YDB_MAX_SUBS], value;
+  while (p < end) {
+    char type = *p++;
+    size_t length, count;
+    varname.buf_addr = (char*)next_record(&p, &length);
+    varname.len_alloc = varname.len_used = length;
+    memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+    for (size_t i=0; i<count; i++) {
+      subs[i].buf_addr = (char*)next_record(&p, &length);
+      subs[i].len_alloc = subs[i].len_used = length;
+    }
+    int status;
+    if (type == 'S') {
+      value.buf_addr = (char*)next_record(&p, &length);
+      value.len_alloc = value.len_used = length;
+      status = ydb_set_s(&varname, count, subs, &value);
+    } else
+      status = ydb_delete_s(&varname, count, subs, YDB_DEL_TREE);
+    if (status != YDB_OK)
+      return status;  // including YDB_TP_RESTART, which makes ydb_tp_s() call us again
+  }
+  return YDB_OK;
+}
+
+// Discard all buffered updates, keeping the buffer's memory for reuse
+static void discard_updates(void) {
+  Updates.buffer.length = 0;
+  Updates.count = 0;
+  Updates.emptied++;
+}
+
+// Apply all buffered updates to YDB in one transaction, then empty the buffer whether or not the transaction succeeded
+// return YDB_OK or a YDB error status
+static int flush_updates(void) {
+  if (!Updates.count)
+    return YDB_OK;
+  int tries = 0;
+  gtm_long_t start = mlua_nanoseconds(0, 0);
+  int status = ydb_tp_s(apply_updates, &tries, NULL, 0, NULL);
+  Updates.last_flush_ns = mlua_nanoseconds(0, 0) - start;
+  Updates.flush_ns += Updates.last_flush_ns;
+  Updates.flushes++;
+  Updates.last_restarts = tries? tries-1: 0;
+  Updates.last_updates = status == YDB_OK? Updates.count: 0;
+  Updates.updates += Updates.last_updates;
+  if (status != YDB_OK)
+    Updates.errors++;
+  discard_updates();
+  return status;
+}
+
+// Flush the updates buffered during a call into Lua that has just ended with lua_pcall() status `error`,
+// or discard them if the call failed so that a failed call makes none of its updates
+// return `error`, or LUA_ERRRUN if the flush failed, in which case the stack is cut back to `base` and the error message pushed
+static int end_updates(lua_State *L, int error, int base) {
+  if (error) {
+    discard_updates();
+    return error;
+  }
+  int status = flush_updates();
+  if (status == YDB_OK)
+    return 0;
+  char message[YDB_MAX_ERRORMSG];
+  ydb_zstatus(message, sizeof(message));
+  lua_settop(L, base);
+  lua_pushfstring(L, "MLua: could not flush database updates: YDB error %d: %s", status, message);
+  return LUA_ERRRUN;
+}
+
+// mlua.flush() applies the updates buffered by mlua.set() and mlua.kill() to YDB now, in one transaction
+// return the number of updates applied; raise a Lua error if the transaction failed, in which case none are applied
+static int mlua_flush(lua_State *L) {
+  size_t count = Updates.count;
+  int status = flush_updates();
+  if (status != YDB_OK)
+    return ydb_error(L, status);
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+// mlua.flushstats() returns a table of statistics of the flushes of buffered updates made so far in this process:
+// flushes, updates (applied), restarts (of transactions), errors (failed flushes), flush_ns (time spent flushing) and pending,
+// and of the last flush alone: last_updates, last_restarts and last_flush_ns
+static int mlua_flushstats(lua_State *L) {
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, Updates.flushes), lua_setfield(L, -2, "flushes");
+  lua_pushinteger(L, Updates.updates), lua_setfield(L, -2, "updates");
+  lua_pushinteger(L, Updates.restarts), lua_setfield(L, -2, "restarts");
+  lua_pushinteger(L, Updates.errors), lua_setfield(L, -2, "errors");
+  lua_pushinteger(L, Updates.flush_ns), lua_setfield(L, -2, "flush_ns");
+  lua_pushinteger(L, Updates.count), lua_setfield(L, -2, "pending");
+  lua_pushinteger(L, Updates.last_updates), lua_setfield(L, -2, "last_updates");
+  lua_pushinteger(L, Updates.last_restarts), lua_setfield(L, -2, "last_restarts");
+  lua_pushinteger(L, Updates.last_flush_ns), lua_setfield(L, -2, "last_flush_ns");
+  return 1;
+}
+
+static const luaL_Reg Mlua_functions[] = {
+  {"children", mlua_children},
+  {"nodes", mlua_nodes},
+  {"set", mlua_set},
+  {"kill", mlua_kill},
+  {"flush", mlua_flush},
+  {"flushstats", mlua_flushstats},
+  {NULL, NULL}
+};
+
+// Open the Lua module 'mlua', which mlua_open() preloads into every lua_State so that Lua code can require'mlua'
+static int luaopen_mlua(lua_State *L) {
+  if (luaL_newmetatable(L, ITERATOR_METATABLE)) {
+    lua_pushcfunction(L, free_iterator);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  luaL_newlib(L, Mlua_functions);
+  return 1;
 }
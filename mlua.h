@@ -9,18 +9,86 @@
 #define MLUA_IGNORE_INIT   0x01  /* Do not process code pointed to by MLUA_INIT environment variable */
 #define MLUA_OPEN_DEFAULT  0x02  /* Used internally to specify opening the default Lua state */
 #define MLUA_BLOCK_SIGNALS 0x04  /* Prevent signals from interrupting Lua (causing EINTR errors during 'slow' I/O) */
+#define MLUA_STREAM_RESULTS 0x08  /* Return a result id for strings too long for the output buffer, so mlua_fetch() can fetch the rest */
+#define MLUA_BLOCK_IO_SIGNALS 0x10  /* Like MLUA_BLOCK_SIGNALS but block signals only around Lua's io and os library calls */
+#define MLUA_POOL_ALLOC    0x20  /* Allocate Lua's small objects from per-lua_State pools rather than from the malloc heap shared with YDB */
+#define MLUA_HUGE_PAGES    0x40  /* Back the pools of MLUA_POOL_ALLOC with transparent huge pages (implies MLUA_POOL_ALLOC) */
+#define MLUA_TIME_CALLS    0x80  /* Measure compile, run and signal-blocking times reported by mlua_stats() */
+#define MLUA_RESETTABLE    0x100  /* Record the globals after init so that mlua_reset() can restore them */
+#define MLUA_LAZY_LIBS     0x200  /* Open standard libraries not selected by mlua_open()'s libs parameter on first use */
 
 // use a value that is not used by YDB or ERRNO in case we decide to return those errors at some later point.
 #define MLUA_ERROR -1
+// returned instead of MLUA_ERROR when a call into Lua is aborted because it exceeded the budget set by mlua_budget()
+#define MLUA_BUDGET -2
+// returned by mlua_wait() when the job has not finished within the timeout
+#define MLUA_TIMEOUT -3
+// returned by mlua_co_next() when the coroutine's function has returned rather than yielded
+#define MLUA_DONE -4
 
 // User functions
 
-// run Lua code, opening lua state if needed; returning nonzero on error (and filling optional errstr if supplied)
+// run Lua code, opening lua state if needed; returning <0 on error (and filling optional errstr if supplied)
+// or a result id >0 if the result was too long for outstr and the lua_State was opened with MLUA_STREAM_RESULTS
 // optional lua_handle must be a lua_State handle returned by lua_open() or 0 to use the global lua_State
 gtm_int_t mlua(int argc, const gtm_string_t *code, gtm_string_t *outstr, gtm_long_t luaState_handle, ...);
 
+// like mlua() but pass up to 8 numeric parameters and return a numeric result in *result, avoiding conversion to/from strings
+// return nonzero on error (filling optional errstr if supplied)
+gtm_int_t mlua_lua_long(int argc, const gtm_string_t *code, gtm_long_t *result, gtm_string_t *errstr, gtm_long_t luaState_handle, ...);
+gtm_int_t mlua_lua_double(int argc, const gtm_string_t *code, gtm_double_t *result, gtm_string_t *errstr, gtm_long_t luaState_handle, ...);
+
+// like mlua() but write all return values into M local varname in one pass: varname=<count>, varname(i)=<value i>
+// table values are written as subtrees varname(i,key,...); return nonzero on error (filling optional errstr if supplied)
+gtm_int_t mlua_lua_into(int argc, const gtm_string_t *code, const gtm_string_t *varname, gtm_string_t *errstr, gtm_long_t luaState_handle, ...);
+
+// fetch the next chunk of a result string whose result id was returned by mlua() on a lua_State opened with MLUA_STREAM_RESULTS
+// return the number of bytes remaining after this chunk (the id is released when it reaches 0) or MLUA_ERROR on error
+gtm_long_t mlua_fetch(int argc, gtm_long_t id, gtm_string_t *outstr, gtm_long_t luaState_handle);
+
+// release a result id before all its chunks have been fetched; return 0 on success or -1 if the id is invalid
+gtm_int_t mlua_release(int argc, gtm_long_t id, gtm_long_t luaState_handle);
+
+// append a chunk to input buffer bufid (0 to create a new one) so that M can stream a large argument into Lua
+// return the buffer id >0 or MLUA_ERROR on error
+gtm_long_t mlua_append(int argc, gtm_long_t bufid, const gtm_string_t *chunk, gtm_long_t luaState_handle);
+
+// like mlua() but pass the contents of input buffer bufid as the first parameter to the Lua function, then free the buffer
+gtm_int_t mlua_lua_buffer(int argc, const gtm_string_t *code, gtm_string_t *outstr, gtm_long_t luaState_handle, gtm_long_t bufid, ...);
+
+// like mlua() but read the whole tree of M variable glvn in C and pass it as a nested table in the first parameter to the Lua
+// function; numeric subscripts become number keys and the value of a node with children is stored at key [true]
+gtm_int_t mlua_lua_tree(int argc, const gtm_string_t *code, gtm_string_t *outstr, gtm_long_t luaState_handle, const gtm_string_t *glvn, ...);
+
+// apply Lua function fn(value,subscript) to every child node of M variable input_glvn in one call,
+// writing each non-nil result to the same subscript of output_glvn; return the number of nodes processed or MLUA_ERROR
+gtm_long_t mlua_map(int argc, const gtm_string_t *fn, const gtm_string_t *input_glvn, const gtm_string_t *output_glvn, gtm_string_t *errstr, gtm_long_t luaState_handle);
+
+// prepare Lua code or a '>function' name once for repeated calls by mlua_call() without re-parsing or name lookup
+// return a function handle >0, or 0 on error (filling optional outstr with the error message)
+gtm_long_t mlua_prepare(int argc, const gtm_string_t *code, gtm_string_t *outstr, gtm_long_t luaState_handle);
+
+// call a function prepared by mlua_prepare() in the same lua_State; parameters and results are as for mlua()
+gtm_int_t mlua_call(int argc, gtm_long_t function_handle, gtm_string_t *outstr, gtm_long_t luaState_handle, ...);
+
+// release a function handle returned by mlua_prepare(); return 0 on success or -1 if the handle is invalid
+gtm_int_t mlua_unprepare(int argc, gtm_long_t function_handle, gtm_long_t luaState_handle);
+
+// start Lua code or a '>function' name as a coroutine with optional string parameters, without running it yet
+// return a coroutine handle >0, or 0 on error (filling optional outstr with the error message)
+gtm_long_t mlua_co_start(int argc, const gtm_string_t *code, gtm_string_t *outstr, gtm_long_t luaState_handle, ...);
+
+// resume a coroutine from mlua_co_start() and return 0 with the value it yields in outstr, or MLUA_DONE with its
+// return value once it returns, or <0 on error; the handle is released when it is done or fails
+gtm_int_t mlua_co_next(int argc, gtm_long_t co_handle, gtm_string_t *outstr, gtm_long_t luaState_handle);
+
+// release a coroutine handle before it is done; return 0 on success or -1 if the handle is invalid
+gtm_int_t mlua_co_release(int argc, gtm_long_t co_handle, gtm_long_t luaState_handle);
+
 // open lua_State and return its luaState_handle
-gtm_long_t mlua_open(int argc, gtm_string_t *outstr, gtm_int_t flags);
+// optional memory_limit is the maximum number of bytes the lua_State may allocate (0 for no limit)
+// optional libs is a comma-separated list of the standard libraries to open (the base and package libraries are always opened)
+gtm_long_t mlua_open(int argc, gtm_string_t *outstr, gtm_int_t flags, gtm_long_t memory_limit, const gtm_string_t *libs);
 
 // close lua_State specified by lua_handle (which may be 0 for the global lua_State)
 gtm_int_t mlua_close(int argc, gtm_long_t lua_handle);
@@ -34,6 +102,68 @@ gtm_int_t mlua_version_number(int _argc);
 // if `process`=1 return a counter of CPU time used by this process
 gtm_long_t mlua_nanoseconds(int argc, gtm_int_t process);
 
+// return statistics on the cache of compiled code strings of lua_State luaState_handle (0 for the global lua_State)
+// as M-parsable output "hits=<n>,misses=<n>,entries=<n>,size=<n>"; return nonzero on error
+gtm_int_t mlua_cache_stats(int argc, gtm_string_t *output, gtm_long_t luaState_handle);
+
+// return statistics on memory allocated by lua_State luaState_handle (0 for the global lua_State) as M-parsable output
+// "inuse=<bytes>,peak=<bytes>,pooled=<blocks>,free=<blocks>,slabs=<bytes>"; return nonzero on error
+gtm_int_t mlua_alloc_stats(int argc, gtm_string_t *output, gtm_long_t luaState_handle);
+
+// return the number of bytes currently allocated by lua_State luaState_handle (0 for the global lua_State), or -1 on error
+// optional peak returns the maximum number of bytes it has had allocated at once
+gtm_long_t mlua_memory(int argc, gtm_long_t luaState_handle, gtm_long_t *peak);
+
+// set the maximum Lua instructions and/or microseconds of real time (0 for no limit) that each call into lua_State luaState_handle
+// may use before it is aborted with return value MLUA_BUDGET; check every `interval` instructions (0 for the default)
+// if next_call_only is nonzero, apply the budget only to the next call; return 0 on success or -1 if a parameter is invalid
+gtm_int_t mlua_budget(int argc, gtm_long_t luaState_handle, gtm_long_t instructions, gtm_long_t microseconds, gtm_int_t interval, gtm_int_t next_call_only);
+
+// return counters of calls, errors, compiles, times and bytes of lua_State luaState_handle (0 for the global lua_State,
+// -1 for totals of all lua_States, plus the process's bytecode_hits) as M-parsable output "calls=<n>,errors=<n>,..."; return nonzero on error
+gtm_int_t mlua_stats(int argc, gtm_string_t *output, gtm_long_t luaState_handle);
+
+// start sampling the Lua call stack of lua_State luaState_handle every `interval` Lua instructions (0 to stop profiling)
+// return 0 on success or -1 if a parameter is invalid
+gtm_int_t mlua_profile(int argc, gtm_long_t luaState_handle, gtm_int_t interval);
+
+// write the stack samples collected by mlua_profile() to file `filename` in flamegraph folded-stack format
+// return 0 on success or nonzero on error (filling optional outstr with the error message)
+gtm_int_t mlua_profile_dump(int argc, const gtm_string_t *filename, gtm_string_t *outstr, gtm_long_t luaState_handle);
+
+// restore the globals and loaded modules of a lua_State opened with MLUA_RESETTABLE to their condition just after it was opened
+// return 0 on success or nonzero on error (filling optional outstr with the error message)
+gtm_int_t mlua_reset(int argc, gtm_long_t luaState_handle, gtm_string_t *outstr);
+
+// return a handle to a pre-initialized lua_State opened with `flags` from the pool, opening a new one if none is free
+// return 0 on error (filling optional outstr with the error message)
+gtm_long_t mlua_pool_get(int argc, gtm_string_t *outstr, gtm_int_t flags);
+
+// reset a lua_State obtained from mlua_pool_get(), clearing its budget, profiling and statistics, and return it to the pool
+// return 0 on success or -1 on error, including if luaState_handle did not come from the pool
+gtm_int_t mlua_pool_put(int argc, gtm_long_t luaState_handle);
+
+// open lua_States with `flags` into the pool until it holds `count` of them; return the number in the pool or -1 on error
+gtm_long_t mlua_pool_fill(int argc, gtm_long_t count, gtm_string_t *outstr, gtm_int_t flags);
+
+// run code (or '>' function name) with up to 8 string arguments in a worker thread whose own lua_State may not call YDB
+// return a job id >0 for mlua_wait() or mlua_cancel(), or -1 on error (filling optional outstr with the error message)
+gtm_long_t mlua_submit(int argc, const gtm_string_t *code, gtm_string_t *outstr, ...);
+
+// wait up to timeout milliseconds (forever if negative or missing) for job_id to finish, then fill outstr with its result
+// and return 0, or -1 if it raised an error or job_id is invalid; return MLUA_TIMEOUT if it has not finished
+gtm_int_t mlua_wait(int argc, gtm_long_t job_id, gtm_string_t *outstr, gtm_long_t timeout);
+
+// return 1 if job_id has finished, 0 if not, or -1 if job_id is invalid
+gtm_int_t mlua_poll(int argc, gtm_long_t job_id);
+
+// cancel job_id, aborting it if it is running, and release its id without collecting its result; return 0 or -1 if job_id is invalid
+gtm_int_t mlua_cancel(int argc, gtm_long_t job_id);
+
+// like mlua_map() but apply fn in `threads` worker threads at once (0 for the default number), writing results in order
+// fn runs in the workers' own lua_States, which may not call YDB; return the number of nodes processed or MLUA_ERROR
+gtm_long_t mlua_pmap(int argc, const gtm_string_t *fn, const gtm_string_t *input_glvn, const gtm_string_t *output_glvn, gtm_string_t *errstr, gtm_long_t threads);
+
 
 /* Version History
 v0.3-2 Makefile now supports not only embedded Lua but alternatively a shared libluaX.Y.so
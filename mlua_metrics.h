@@ -0,0 +1,38 @@
+// Lua for MUMPS shared-memory metrics file layout
+
+// MLua processes publish per-process call counters into a file named by environment variable MLUA_METRICS,
+// which they all mmap, so that an external monitor (mlua-top) can read them without touching the processes
+
+#ifndef MLUA_METRICS_H
+#define MLUA_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define METRICS_MAGIC   0x5254454d41554c4dULL  /* "MLUAMETR" in little-endian byte order */
+#define METRICS_VERSION 1
+#define METRICS_SLOTS   1024  /* maximum number of processes that can publish metrics at once */
+#define METRICS_BUCKETS 32  /* latency histogram bucket 0 counts calls under 1us; bucket i counts calls of 2^(i-1) to 2^i us */
+
+// Metrics of one process
+// The writer makes `seq` odd while it updates the counters so that readers can detect (and retry) a torn read
+typedef struct metrics_slot_t {
+  _Atomic int32_t pid;  // process that owns this slot, or 0 if free
+  _Atomic uint32_t seq;  // seqlock sequence number
+  uint64_t calls;  // calls into Lua
+  uint64_t errors;  // calls that returned an error
+  uint64_t run_ns;  // total time of calls into Lua, including signal blocking
+  uint64_t histogram[METRICS_BUCKETS];  // latency histogram of calls into Lua
+} metrics_slot_t;
+
+// Layout of the whole metrics file
+typedef struct metrics_file_t {
+  uint64_t magic;  // METRICS_MAGIC once the file is initialized
+  uint32_t version;  // METRICS_VERSION
+  uint32_t slots;  // number of elements in slot[]
+  metrics_slot_t slot[];
+} metrics_file_t;
+
+#define METRICS_FILE_SIZE (sizeof(metrics_file_t) + METRICS_SLOTS*sizeof(metrics_slot_t))
+
+#endif // MLUA_METRICS_H
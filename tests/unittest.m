@@ -3,7 +3,7 @@
 ;Invoke run() from command line: run^unittest <commands>
 run()
  new allTests
- set allTests="testBasics testParameters testReadme testTreeHeight testLuaStates testInit testSignals"
+ set allTests="testBasics testParameters testReadme testTreeHeight testLuaStates testInit testSignals testCache testPrepare testNumeric testInto testStream testAppend testMap testAlloc testMemory testBudget testJITBudget testStats testMetrics testProfile testReset testPool testLibs testBytecodeCache testCodeStore testWorkers testPmap testCoroutines testTree testIterators testUpdates"
  if $zcmdline'="" set allTests=$zcmdline
  w "Testing: ",allTests,!
  do test(allTests)
@@ -234,7 +234,7 @@ testInit()
 
 ;Test whether signals can interrupt Lua code
 testSignals()
- new pid,cmd1,cmd2,signal,captureFunc,handle,output,MluaBlockSignals
+ new pid,cmd1,cmd2,signal,captureFunc,handle,output,MluaBlockSignals,MluaBlockIOSignals
  set pid=$$lua("local f=assert(io.open('/proc/self/stat'), 'Cannot open /proc/self/stat') local pid=assert(f:read('*n'), 'Cannot read PID from /proc/self/stat') f:close() return pid")
  set captureFunc="function capture(cmd) local f=assert(io.popen(cmd)) local s=assert(f:read('*a')) f:close() return s end"
  set cmd1="kill -s CONT "_pid_" && sleep 0.1 && echo -n Complete 2>/dev/null"
@@ -262,4 +262,885 @@ testSignals()
  ;do the same again with SIGALRM
  do assert(0,$&mlua.lua("return capture('"_cmd2_"')",.output,handle))
  do assert("Complete",output)
+
+ ;now with MLUA_BLOCK_IO_SIGNALS flag set, which blocks signals only during IO functions
+ set MluaBlockIOSignals=16  ;from mlua.h
+ set handle=$&mlua.open(.output,MluaBlockIOSignals)
+ do assert(0,$&mlua.lua(captureFunc,.output,handle))
+ do assert("",output)
+ do assert(0,$&mlua.lua("return capture('"_cmd1_"')",.output,handle))
+ do assert("Complete",output)
+ do assert(0,$&mlua.lua("return capture('"_cmd2_"')",.output,handle))
+ do assert("Complete",output)
+ ;iterators returned by IO functions must also block signals
+ do assert(0,$&mlua.lua("local s='' for line in io.popen('"_cmd1_"'):lines() do s=s..line end return s",.output,handle))
+ do assert("Complete",output)
+ ;errors inside wrapped IO functions must still be reported
+ do assertNot(0,$&mlua.lua("io.open('/nonexistent'):read()",.output,handle))
+ quit
+;Test that repeated code strings are fetched from the cache of compiled code
+testCache()
+ new output,handle,i
+ set handle=$&mlua.open()
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=0,misses=0,entries=0,size=64",output)
+ for i=1:1:3 do assert(0,$&mlua.lua("return ...",.output,handle,i)) do assert(i,output)
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=2,misses=1,entries=1,size=64",output)
+ ;function names are looked up, not compiled, so they do not use the cache
+ do assert(0,$&mlua.lua(">string.lower",.output,handle,"ABC"))
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=2,misses=1,entries=1,size=64",output)
+ ;code that fails to compile is not cached
+ do assertNot(0,$&mlua.lua("junk",.output,handle))
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=2,misses=2,entries=1,size=64",output)
+ ;check that the least recently used code is evicted when the cache is full
+ for i=1:1:64 do assert(0,$&mlua.lua("return "_i,.output,handle)) do assert(i,output)
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=2,misses=66,entries=64,size=64",output)
+ do assert(0,$&mlua.lua("return ...",.output,handle,2))
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=2,misses=67,entries=64,size=64",output)
+ do assert(0,$&mlua.lua("return 64",.output,handle))
+ do assert(0,$&mlua.cachestats(.output,handle))
+ do assert("hits=3,misses=67,entries=64,size=64",output)
+ do assertNot(0,$&mlua.cachestats(.output,100))
+ do assert("MLua: supplied luaState (100) is invalid",output)
+ quit
+;Test calling functions prepared with mlua.prepare()
+testPrepare()
+ new output,handle,cat,add,fail,newState
+ do lua("function cat(...) return table.concat({...}) end")
+ set cat=$&mlua.prepare(">cat",.output)
+ do assertNot(0,cat)
+ do assert("",output)
+ do assert(0,$&mlua.call(cat,.output))
+ do assert("",output)
+ do assert(0,$&mlua.call(cat,.output,,1,2,3,4,5,6,7,8))
+ do assert("12345678",output)
+ ;prepared functions stay bound even if the global name is reassigned
+ do lua("cat=nil")
+ do assert(0,$&mlua.call(cat,.output,,"a","b"))
+ do assert("ab",output)
+ ;code strings can be prepared, too
+ set add=$&mlua.prepare("return ...+1",.output)
+ do assertNot(cat,add)
+ do assert(0,$&mlua.call(add,.output,,41))
+ do assert(42,output)
+ ;check errors
+ do assert(0,$&mlua.prepare(">unknown_func",.output))
+ do assert("Lua: could not find function 'unknown_func'",output)
+ do assert(0,$&mlua.prepare("junk",.output))
+ do assertNot("",output)
+ set fail=$&mlua.prepare("error(...,0)",.output)
+ do assertNot(0,$&mlua.call(fail,.output,,"oops"))
+ do assert("Lua: oops",output)
+ do assertNot(0,$&mlua.call(0,.output))
+ do assert("MLua: supplied function handle (0) is invalid",output)
+ do assertNot(0,$&mlua.call(99,.output))
+ do assert("MLua: supplied function handle (99) is invalid",output)
+ ;function handles belong to the lua_State that prepared them
+ set newState=$&mlua.open()
+ do assertNot(0,$&mlua.call(add,.output,newState,1))
+ do assert("MLua: supplied function handle ("_add_") is invalid",output)
+ set handle=$&mlua.prepare(">string.upper",.output,newState)
+ do assert(0,$&mlua.call(handle,.output,newState,"abc"))
+ do assert("ABC",output)
+ ;check release of function handles
+ do assert(0,$&mlua.unprepare(add))
+ do assert(-1,$&mlua.unprepare(add))
+ do assertNot(0,$&mlua.call(add,.output,,1))
+ do assert("MLua: supplied function handle ("_add_") is invalid",output)
+ do assert(0,$&mlua.call(cat,.output,,"c"))
+ do assert("c",output)
+ quit
+;Test typed numeric entry points mlua.long() and mlua.double()
+testNumeric()
+ new result,output
+ do lua("function add(a,b) return a+b end")
+ do assert(0,$&mlua.long(">add",.result,.output,,3,4))
+ do assert(7,result)
+ do assert("",output)
+ do assert(0,$&mlua.long(">add",.result,.output,,-5,2))
+ do assert(-3,result)
+ do assert(0,$&mlua.long("return select('#',...)",.result,.output,,1,2,3,4,5,6,7,8))
+ do assert(8,result)
+ do assert(0,$&mlua.long("return 2^40",.result,.output))
+ do assert(1099511627776,result)
+ do assert(0,$&mlua.double(">add",.result,.output,,3.5,0.25))
+ do assert(3.75,result)
+ do assert(0,$&mlua.double("return math.pi",.result,.output))
+ do assert(3.14159,$justify(result,0,5))
+ ;numeric strings are converted
+ do assert(0,$&mlua.long("return '12'",.result,.output))
+ do assert(12,result)
+ ;non-numeric results are errors
+ do assertNot(0,$&mlua.long("return 1.5",.result,.output))
+ do assert("MLua: function returned non-integer 1.5 where an integer was expected",output)
+ do assertNot(0,$&mlua.double("return {}",.result,.output))
+ do assert("MLua: function returned type table where a number was expected",output)
+ do assertNot(0,$&mlua.long(">unknown_func",.result,.output))
+ do assert("Lua: could not find function 'unknown_func'",output)
+ quit
+;Test writing multiple return values into an M local with mlua.into()
+testInto()
+ new output,rec,expected
+ set rec="junk",rec("junk")=1
+ do assert(0,$&mlua.into("return 'a',2,true,nil,...","rec",.output,,"x","y"))
+ do assert("",output)
+ do assert(6,rec)
+ do assert("a",rec(1))
+ do assert(2,rec(2))
+ do assert(1,rec(3))
+ do assert("",rec(4))
+ do assert("x",rec(5))
+ do assert("y",rec(6))
+ do assert(0,$data(rec("junk")))
+ ;tables become subtrees
+ do assert(0,$&mlua.into("return {name='oak', height=15, leaves={10,20}}, 1e20","rec",.output))
+ do assert(2,rec)
+ do assert(10,$data(rec(1)))
+ do assert("oak",rec(1,"name"))
+ do assert(15,rec(1,"height"))
+ do assert(10,rec(1,"leaves",1))
+ do assert(20,rec(1,"leaves",2))
+ do assert(1E20,+rec(2))
+ ;no return values
+ do assert(0,$&mlua.into("x=1","rec",.output))
+ do assert(0,rec)
+ do assert(1,$data(rec))
+ ;check errors
+ do assertNot(0,$&mlua.into("error('oops',0)","rec",.output))
+ do assert("Lua: oops",output)
+ do assertNot(0,$&mlua.into("return {[{}]=1}","rec",.output))
+ do assert("MLua: cannot convert table key of type table to an M subscript",output)
+ do assertNot(0,$&mlua.into("local t={} t[1]=t return t","rec",.output))
+ do assert("MLua: table nesting exceeds the maximum of 31 M subscripts",output)
+ do assertNot(0,$&mlua.into("return 1","1bad",.output))
+ do assert("MLua: YDB error",$extract(output,1,15))
+ quit
+;Test streaming of results longer than the output buffer with mlua.fetch()
+testStream()
+ new output,handle,id,remaining,MluaStreamResults
+ set MluaStreamResults=8  ;from mlua.h
+ ;without MLUA_STREAM_RESULTS, long results are truncated
+ do assert(0,$&mlua.lua("return string.rep('abc',1000000)",.output))
+ do assert(1048576,$length(output))
+ set handle=$&mlua.open(.output,MluaStreamResults)
+ ;short results are returned as usual
+ do assert(0,$&mlua.lua("return 'abc'",.output,handle))
+ do assert("abc",output)
+ set id=$&mlua.lua("return string.rep('abc',1000000)",.output,handle)
+ do assert(1,id>0,"expected a result id")
+ do assert(1048576,$length(output))
+ do assert("abcabc",$extract(output,1,6))
+ set remaining=$&mlua.fetch(id,.output,handle)
+ do assert(3000000-(2*1048576),remaining)
+ do assert(1048576,$length(output))
+ do assert("cabcab",$extract(output,1,6))  ;1048576 is 1 mod 3
+ set remaining=$&mlua.fetch(id,.output,handle)
+ do assert(0,remaining)
+ do assert(3000000-(2*1048576),$length(output))
+ do assert("bcabca",$extract(output,1,6))
+ ;a fully fetched result id is released
+ do assert(-1,$&mlua.fetch(id,.output,handle))
+ do assert("MLua: supplied result id ("_id_") is invalid",output)
+ ;check early release
+ set id=$&mlua.lua("return string.rep('x',2000000)",.output,handle)
+ do assert(1,id>0,"expected a result id")
+ do assert(0,$&mlua.release(id,handle))
+ do assert(-1,$&mlua.release(id,handle))
+ do assert(-1,$&mlua.fetch(id,.output,handle))
+ ;several results may be streamed at once
+ set id(1)=$&mlua.lua("return string.rep('1',1048577)",.output,handle)
+ set id(2)=$&mlua.lua("return string.rep('2',1048578)",.output,handle)
+ do assertNot(id(1),id(2))
+ do assert(0,$&mlua.fetch(id(2),.output,handle))
+ do assert("22",output)
+ do assert(0,$&mlua.fetch(id(1),.output,handle))
+ do assert("1",output)
+ quit
+;Test streaming large arguments into Lua with mlua.append() and mlua.buffer()
+testAppend()
+ new output,bufid,bufid2,i,chunk
+ set bufid=$&mlua.append(0,"abc")
+ do assert(1,bufid>0,"expected a buffer id")
+ do assert(bufid,$&mlua.append(bufid,"def"))
+ do assert(0,$&mlua.buffer("return ...",.output,,bufid))
+ do assert("abcdef",output)
+ ;the buffer is freed once used
+ do assertNot(0,$&mlua.buffer("return ...",.output,,bufid))
+ do assert("MLua: supplied buffer id ("_bufid_") is invalid",output)
+ do assert(-1,$&mlua.append(bufid,"x"))
+ ;stream several megabytes, passing extra parameters after the buffer
+ set chunk=$translate($justify("",100000)," ","x")
+ set bufid=$&mlua.append(0,"")
+ for i=1:1:50 do assert(bufid,$&mlua.append(bufid,chunk))
+ set bufid2=$&mlua.append(0,"second")
+ do assertNot(bufid,bufid2)
+ do assert(0,$&mlua.buffer("local s,a,b=... return #s..a..b..select('#',...)",.output,,bufid,"+","+"))
+ do assert("5000000++3",output)
+ do assert(0,$&mlua.buffer("return ...",.output,,bufid2))
+ do assert("second",output)
+ ;empty buffers are passed as empty strings
+ set bufid=$&mlua.append(0)
+ do assert(0,$&mlua.buffer("return type(...)..#...",.output,,bufid))
+ do assert("string0",output)
+ ;the buffer is freed even if the code does not compile
+ set bufid=$&mlua.append(0,"abc")
+ do assertNot(0,$&mlua.buffer("junk",.output,,bufid))
+ do assert(-1,$&mlua.append(bufid,"x"))
+ quit
+;Test applying a Lua function to every node of an M array with mlua.map()
+testMap()
+ new output,in,out,i,handle
+ for i=1:1:10 set in("x",i)=i
+ set in("x",5,"child")="ignored",in("x","a""b")="quoted"
+ kill in("x",7) set in("x",7,"child")="no value"
+ do lua("function square(v,sub) if sub=='3' then return nil end return tonumber(v) and v*v or sub..'='..v end")
+ do assert(10,$&mlua.map(">square","in(""x"")","out(1)",.output))
+ do assert("",output)
+ do assert(1,out(1,1))
+ do assert(4,out(1,2))
+ do assert(0,$data(out(1,3)))
+ do assert(25,out(1,5))
+ do assert(0,$data(out(1,7)))
+ do assert(100,out(1,10))
+ do assert("a""b=quoted",out(1,"a""b"))
+ do assert(0,$data(out(1,5,"child")))
+ ;globals work too, with code strings rather than function names
+ kill ^mapin,^mapout
+ for i=1:1:1000 set ^mapin(i)=i
+ do assert(1000,$&mlua.map("return ...+1","^mapin","^mapout",.output))
+ do assert(1001,^mapout(1000))
+ do assert(0,$&mlua.map("return 1","^mapempty","^mapout",.output))
+ ;map in a lua_State that blocks signals
+ set handle=$&mlua.open(.output,4)
+ do assert(1000,$&mlua.map("return ...*2","^mapin","mapout",.output,handle))
+ do assert(2000,mapout(1000))
+ ;check errors
+ do assertNot(0,$&mlua.map("error('oops',0)","^mapin","^mapout",.output))
+ do assert("Lua: oops",output)
+ do assertNot(0,$&mlua.map("return 1","in(""x""","out",.output))
+ do assert("MLua: input variable invalid variable name syntax",output)
+ do assertNot(0,$&mlua.map("return 1","in","out(,)",.output))
+ do assert("MLua: output variable invalid variable name syntax",output)
+ do assertNot(0,$&mlua.map(">unknown_func","in","out",.output))
+ do assert("Lua: could not find function 'unknown_func'",output)
+ quit
+;Test memory allocator statistics with and without pooled allocation
+testAlloc()
+ new output,handle,stat
+ ;default lua_States count allocations but do not pool them
+ set handle=$&mlua.open()
+ do assert(0,$&mlua.allocstats(.output,handle))
+ set stat=$piece($piece(output,",",1),"=",2)
+ do assert(1,stat>0,"inuse="_stat_" should be >0")
+ do assert(1,$piece($piece(output,",",2),"=",2)'<stat)
+ do assert("pooled=0,free=0,slabs=0",$piece(output,",",3,5))
+ ;MLUA_POOL_ALLOC lua_States allocate small objects from pools
+ set handle=$&mlua.open(.output,32)  ;MLUA_POOL_ALLOC from mlua.h
+ do assert(0,$&mlua.lua("t={} for i=1,10000 do t[i]={i} end",.output,handle))
+ do assert(0,$&mlua.allocstats(.output,handle))
+ do assert(1,$piece($piece(output,",",3),"=",2)>10000,output)
+ do assert(1,$piece($piece(output,",",5),"=",2)>0,output)
+ set stat=$piece($piece(output,",",2),"=",2)
+ ;freed objects are returned to the pools and peak remembers the highest use
+ do assert(0,$&mlua.lua("t=nil collectgarbage()",.output,handle))
+ do assert(0,$&mlua.allocstats(.output,handle))
+ do assert(1,$piece($piece(output,",",4),"=",2)>10000,output)
+ do assert(1,$piece($piece(output,",",1),"=",2)<stat,output)
+ do assert(stat,$piece($piece(output,",",2),"=",2))
+ ;pooled lua_States must still run code that allocates large objects
+ do assert(0,$&mlua.lua("return #string.rep('x',100000)",.output,handle))
+ do assert(100000,output)
+ ;MLUA_HUGE_PAGES implies pooling
+ set handle=$&mlua.open(.output,64)
+ do assert(0,$&mlua.lua("return ('a'):rep(3)",.output,handle))
+ do assert("aaa",output)
+ do assert(0,$&mlua.allocstats(.output,handle))
+ do assert(1,$piece($piece(output,",",3),"=",2)>0,output)
+ do assertNot(0,$&mlua.allocstats(.output,999))
+ do assert("MLua: supplied luaState (999) is invalid",output)
+ quit
+;Test per-lua_State memory limits and memory reporting
+testMemory()
+ new output,handle,peak,used
+ set handle=$&mlua.open(.output,0,1000000)
+ do assert("",output)
+ set used=$&mlua.memory(handle,.peak)
+ do assert(1,used>0,"memory in use="_used)
+ do assert(1,peak'<used,"peak="_peak_" used="_used)
+ ;allocating within the limit works, and raises peak
+ do assert(0,$&mlua.lua("s=string.rep('x',500000) return #s",.output,handle))
+ do assert(500000,output)
+ do assert(1,$&mlua.memory(handle,.peak)>500000)
+ do assert(1,peak>500000)
+ ;allocating past the limit raises a Lua memory error
+ do assertNot(0,$&mlua.lua("t={} for i=1,1e6 do t[i]=i end",.output,handle))
+ do assert("Lua: not enough memory",output)
+ set used=$&mlua.memory(handle,.peak)
+ do assert(1,peak'>1000000,"peak="_peak_" exceeds limit")
+ ;parameters are pushed outside the limit, so one that exceeds it cannot abort the process with an unprotected error
+ do assert(0,$&mlua.lua("return #...",.output,handle,$translate($justify("",999999)," ","x")))
+ do assert(999999,output)
+ ;the lua_State is still usable after freeing memory
+ do assert(0,$&mlua.lua("s=nil t=nil collectgarbage() return 'ok'",.output,handle))
+ do assert("ok",output)
+ do assert(1,$&mlua.memory(handle)<500000)
+ ;a limit too small to open the Lua libraries fails to open the lua_State
+ do assert(0,$&mlua.open(.output,0,100))
+ do assertNot("",output)
+ do assert(0,$&mlua.open(.output,0,-1))
+ do assert("MLua: memory limit (-1) must not be negative",output)
+ do assert(-1,$&mlua.memory(999))
+ quit
+;Test instruction and time budgets that abort runaway Lua calls
+testBudget()
+ new output,handle,start,o
+ set handle=$&mlua.open()
+ ;an instruction budget aborts an infinite loop with MLUA_BUDGET (-2)
+ do assert(0,$&mlua.budget(handle,100000))
+ do assert(-2,$&mlua.lua("while true do end",.output,handle))
+ do assert(1,output["call exceeded its budget",output)
+ ;the lua_State remains usable and code within budget runs normally
+ do assert(0,$&mlua.lua("local x=0 for i=1,1000 do x=x+i end return x",.output,handle))
+ do assert(500500,output)
+ ;Lua code cannot escape the budget by catching the error
+ do assert(-2,$&mlua.lua("while true do pcall(function() while true do end end) end",.output,handle))
+ ;the budget applies to the other entry points too
+ do assert(-2,$&mlua.long("while true do end",.o,.output,handle))
+ do assert(-2,$&mlua.into("while true do end","o",.output,handle))
+ ;a time budget aborts the call after the deadline
+ do assert(0,$&mlua.budget(handle,0,100000))
+ set start=$&mlua.nanoseconds()
+ do assert(-2,$&mlua.lua("while true do end",.output,handle))
+ do assert(1,$&mlua.nanoseconds()-start<2000000000,"time budget took too long to abort the call")
+ ;a per-call budget overrides the lua_State's budget for the next call only
+ do assert(0,$&mlua.budget(handle,0,0))
+ do assert(0,$&mlua.budget(handle,1000,0,10,1))
+ do assert(-2,$&mlua.lua("for i=1,100000 do end",.output,handle))
+ do assert(0,$&mlua.lua("for i=1,100000 do end",.output,handle))
+ ;invalid parameters
+ do assert(-1,$&mlua.budget(999,1000))
+ do assert(-1,$&mlua.budget(handle,-1))
+ quit
+;Test that under LuaJIT a budget still aborts code that has already been JIT-compiled, and that the JIT mode is restored
+testJITBudget()
+ new output,handle
+ if $$lua("return jit==nil")="true" write "  Skipping: not LuaJIT",! quit
+ set handle=$&mlua.open()
+ ;run the loop unbudgeted until LuaJIT has compiled it
+ do assert(0,$&mlua.lua("function spin(n) local i=0 while not n or i<n do i=i+1 end return i end return spin(1e7)",.output,handle))
+ do assert(10000000,output)
+ do assert(0,$&mlua.budget(handle,100000))
+ do assert(0,$&mlua.lua("return (jit.status())",.output,handle))
+ do assert("false",output)
+ do assert(-2,$&mlua.lua("spin()",.output,handle))
+ do assert(1,output["call exceeded its budget",output)
+ ;removing the budget restores the JIT
+ do assert(0,$&mlua.budget(handle,0,0))
+ do assert(0,$&mlua.lua("return (jit.status())",.output,handle))
+ do assert("true",output)
+ ;but does not switch on a JIT that Lua code switched off
+ do assert(0,$&mlua.lua("jit.off()",.output,handle))
+ do assert(0,$&mlua.budget(handle,100000))
+ do assert(-2,$&mlua.lua("spin()",.output,handle))
+ do assert(0,$&mlua.budget(handle,0,0))
+ do assert(0,$&mlua.lua("return (jit.status())",.output,handle))
+ do assert("false",output)
+ do assert(0,$&mlua.close(handle))
+ quit
+;Test per-lua_State and process-wide call statistics
+testStats()
+ new output,handle,stats,total,o
+ set handle=$&mlua.open()
+ do assert(0,$&mlua.stats(.output,handle))
+ do assert("calls=0,errors=0,compiles=0,compile_ns=0,run_ns=0,signal_ns=0,bytes_in=0,bytes_out=0,truncations=0",output)
+ do assert(0,$&mlua.lua("return ...",.output,handle,"abc"))
+ do assert(0,$&mlua.lua("return ...",.output,handle,"de"))
+ do assertNot(0,$&mlua.lua("error('x')",.output,handle))
+ do assert(0,$&mlua.stats(.output,handle))
+ do stats(output,.stats)
+ do assert(3,stats("calls"))
+ do assert(1,stats("errors"))
+ do assert(2,stats("compiles"))
+ do assert(5,stats("bytes_in"))
+ do assert(5,stats("bytes_out"))
+ do assert(0,stats("run_ns"))
+ ;results too long for the output string are counted as truncations
+ do assert(0,$&mlua.lua("return string.rep('x',2000000)",.output,handle))
+ do assert(0,$&mlua.stats(.output,handle))
+ do stats(output,.stats)
+ do assert(1,stats("truncations"))
+ ;MLUA_TIME_CALLS measures times
+ set handle=$&mlua.open(.output,128)
+ do assert(0,$&mlua.lua("local x=0 for i=1,100000 do x=x+i end",.output,handle))
+ do assert(0,$&mlua.stats(.output,handle))
+ do stats(output,.stats)
+ do assert(1,stats("run_ns")>0,output)
+ do assert(1,stats("compile_ns")>0,output)
+ ;totals include closed lua_States
+ do assert(0,$&mlua.stats(.output,-1))
+ do stats(output,.total)
+ do assert(1,total("calls")'<5,output)
+ do assert(0,$&mlua.close(handle))
+ do assert(0,$&mlua.stats(.output,-1))
+ kill stats do stats(output,.stats)
+ do assert(total("calls"),stats("calls"))
+ do assertNot(0,$&mlua.stats(.output,999))
+ quit
+;Parse M-parsable statistics "name=value,..." into array
+stats(string,array)
+ new i,pair
+ for i=1:1:$length(string,",") set pair=$piece(string,",",i),array($piece(pair,"=",1))=$piece(pair,"=",2)
+ quit
+;Test that a process started with MLUA_METRICS publishes metrics that mlua-top can read
+testMetrics()
+ new output,file,cmd,total
+ if '$$lua("local f=io.open('mlua-top') return f~=nil and io.close(f)") write "  Skipping: mlua-top not built",! quit
+ set file="/tmp/mlua-metrics-test-"_$job
+ ;the child process makes two Lua calls (one failing) and a map, then runs mlua-top while it is still alive to see its own slot
+ set cmd="MLUA_METRICS="_file_" $ydb_dist/yottadb -run %XCMD 'do &mlua.lua(""return 1"") set x(1)=1 do &mlua.map(""return 1"",""x"",""y"") if $&mlua.lua(""error()"") zsystem ""./mlua-top -1 "_file_"""'"
+ set output=$$lua("local f=assert(io.popen(...)) local s=f:read('*a') f:close() os.remove('"_file_"') return s",cmd)
+ ;TOTAL line columns are calls then errors
+ set total=$$lua("return table.concat({(...):match('TOTAL%s+(%d+)%s+(%d+)')},',')",output)
+ do assert("3,1",total,"mlua-top output: "_output)
+ do assert(1,output["1 processes")
+ ;a metrics file that others can write to is not used, so it is not even sized
+ do assert(0,$&mlua.lua("io.open('"_file_"','w'):close() os.execute('chmod 666 "_file_"')",.output))
+ set cmd="MLUA_METRICS="_file_" $ydb_dist/yottadb -run %XCMD 'do &mlua.lua(""return 1"")'"
+ do assert(0,$$lua("os.execute(...) local f=io.open('"_file_"') local size=f:seek('end') f:close() os.remove('"_file_"') return size",cmd))
+ quit
+;Test the sampling profiler and its flamegraph-format dump
+testProfile()
+ new output,handle,file,dump
+ set file="/tmp/mlua-profile-test-"_$job
+ set handle=$&mlua.open()
+ do assert(0,$&mlua.lua("function busy() local x=0 for i=1,1000000 do x=x+i end return x end function outer() local x=busy() return x end",.output,handle))
+ do assertNot(0,$&mlua.profiledump(file,.output,handle))
+ do assert("MLua: luaState ("_handle_") is not being profiled",output)
+ do assert(0,$&mlua.profile(handle,1000))
+ do assert(0,$&mlua.lua(">outer",.output,handle))
+ do assert(0,$&mlua.profiledump(file,.output,handle))
+ do assert("",output)
+ set dump=$$lua("local f=assert(io.open(...)) local s=f:read('*a') f:close() os.remove(...) return s",file)
+ ;every line is a folded stack of frames followed by a sample count
+ do assert(1,$$lua("for line in (...):gmatch('[^\n]+') do if not line:match('^[^;]+;.* %d+$') then return false end end return true",dump),dump)
+ ;outer is unnamed because it is called from C
+ do assert(1,dump["function (mlua(code):1);busy (mlua(code):1)",dump)
+ ;roughly one sample per 1000 instructions of the 1M iteration loop
+ do assert(1,$$lua("local n=0 for count in (...):gmatch(' (%d+)\n') do n=n+count end return n>1000",dump),dump)
+ ;profiling works together with a budget
+ do assert(0,$&mlua.budget(handle,100000))
+ do assert(-2,$&mlua.lua(">outer",.output,handle))
+ do assert(0,$&mlua.budget(handle,0))
+ ;stopping the profiler discards its samples
+ do assert(0,$&mlua.profile(handle,0))
+ do assertNot(0,$&mlua.profiledump(file,.output,handle))
+ do assert(-1,$&mlua.profile(handle,-1))
+ quit
+;Test that mlua.reset() restores a lua_State to its condition after init
+testReset()
+ new output,handle,prepared
+ set handle=$&mlua.open(.output,256)  ;MLUA_RESETTABLE from mlua.h
+ do assert("",output)
+ ;MLUA_INIT (set by the Makefile) has run and is part of the baseline
+ do assert(0,$&mlua.lua("return inittest",.output,handle))
+ do assert(1,output)
+ do assert(0,$&mlua.lua("x=1 inittest=2 string.custom=1 print=nil package.loaded.fake={} setmetatable(_G,{__index=function() return 'meta' end})",.output,handle))
+ do assert(0,$&mlua.lua("return undefined",.output,handle))
+ do assert("meta",output)
+ do assert(0,$&mlua.reset(handle,.output))
+ do assert("",output)
+ do assert(0,$&mlua.lua("return tostring(x)..inittest..tostring(string.custom)..type(print)..tostring(package.loaded.fake)..tostring(getmetatable(_G))",.output,handle))
+ do assert("nil1nilfunctionnilnil",output)
+ ;prepared functions are discarded by reset
+ set prepared=$&mlua.prepare("return 1",.output,handle)
+ do assert(0,$&mlua.reset(handle))
+ do assertNot(0,$&mlua.call(prepared,.output,handle))
+ ;only lua_States opened with MLUA_RESETTABLE can be reset
+ set handle=$&mlua.open()
+ do assertNot(0,$&mlua.reset(handle,.output))
+ do assert("MLua: luaState ("_handle_") was not opened with MLUA_RESETTABLE",output)
+ quit
+;Test the pool of pre-initialized lua_States
+testPool()
+ new output,handle,handle2,other
+ do assert(2,$&mlua.poolfill(2,.output))
+ do assert(2,$&mlua.poolfill(1,.output))
+ set handle=$&mlua.poolget(.output)
+ do assertNot(0,handle)
+ set handle2=$&mlua.poolget(.output)
+ do assertNot(handle,handle2)
+ do assert(0,$&mlua.lua("leaked=1",.output,handle))
+ do assert(0,$&mlua.poolput(handle))
+ do assert(0,$&mlua.poolput(handle2))
+ ;states returned to the pool are reused, and are reset
+ do assert(handle,$&mlua.poolget(.output))
+ do assert(0,$&mlua.lua("return tostring(leaked)",.output,handle))
+ do assert("nil",output)
+ ;states with different flags are pooled separately
+ set handle2=$&mlua.poolget(.output,4)
+ do assertNot(handle,handle2)
+ do assert(0,$&mlua.poolput(handle2))
+ do assert(-1,$&mlua.poolput(999))
+ ;budgets, profiling and statistics are not handed on to the next user of a pooled state
+ set handle=$&mlua.poolget(.output)
+ do assert(0,$&mlua.budget(handle,1000))
+ do assert(0,$&mlua.profile(handle,100))
+ do assert(0,$&mlua.lua("return 1",.output,handle))
+ do assert(0,$&mlua.poolput(handle))
+ do assert(handle,$&mlua.poolget(.output))
+ do assert(0,$&mlua.lua("for i=1,100000 do end",.output,handle))
+ do assert(-1,$&mlua.profiledump("/dev/null",.output,handle))
+ do assert("MLua: luaState ("_handle_") is not being profiled",output)
+ do assert(0,$&mlua.stats(.output,handle))
+ do assert(1,output["calls=1,",output)
+ do assert(0,$&mlua.poolput(handle))
+ ;only states taken from the pool may be put into it
+ set other=$&mlua.open(.output,256)  ;MLUA_RESETTABLE from mlua.h
+ do assert(-1,$&mlua.poolput(other))
+ do assert(0,$&mlua.close(other))
+ quit
+;Test opening lua_States with selected and lazily-opened standard libraries
+testLibs()
+ new output,handle
+ ;only the selected libraries are opened, plus base and package
+ set handle=$&mlua.open(.output,0,0,"string,table")
+ do assert("",output)
+ do assert(0,$&mlua.lua("return type(string)..type(table)..type(io)..type(os)..type(require)..type(print)",.output,handle))
+ do assert("tabletablenilniltablefunction",output)
+ do assert(0,$&mlua.lua("return (pcall(require,'io'))",.output,handle))
+ do assert("false",output)
+ ;unlisted libraries are opened on first use with MLUA_LAZY_LIBS
+ set handle=$&mlua.open(.output,512,0,"string")
+ do assert("",output)
+ do assert(0,$&mlua.lua("return rawget(_G,'math')",.output,handle))
+ do assert("",output)
+ do assert(0,$&mlua.lua("return math.floor(2.5)..type(rawget(_G,'math'))",.output,handle))
+ do assert("2table",output)
+ do assert(0,$&mlua.lua("return require('os')==os",.output,handle))
+ do assert("true",output)
+ do assert(0,$&mlua.lua("return tostring(undefined)",.output,handle))
+ do assert("nil",output)
+ ;lazy libraries can be opened again after reset
+ set handle=$&mlua.open(.output,512+256)
+ do assert(0,$&mlua.lua("return io.write~=nil",.output,handle))
+ do assert("true",output)
+ do assert(0,$&mlua.reset(handle))
+ do assert(0,$&mlua.lua("return io.write~=nil",.output,handle))
+ do assert("true",output)
+ ;unknown library names are reported
+ do assert(0,$&mlua.open(.output,0,0,"string,nosuchlib"))
+ do assert("Lua: in init luaL_openlibs(), unknown library 'nosuchlib'",output)
+ quit
+;Test the on-disk bytecode cache used by require() and MLUA_INIT
+testBytecodeCache()
+ new output,handle,dir,stats,hits,init
+ do assert(0,$&mlua.lua("dir=os.tmpname() os.remove(dir) os.execute('mkdir -p '..dir..'/cache && chmod 700 '..dir..'/cache') return dir",.dir))
+ do assert(0,$&mlua.lua("local f=io.open('"_dir_"/cachedmod.lua','w') f:write('return {x=1}') f:close()",.output))
+ view "SETENV":"MLUA_BYTECODE_CACHE":dir_"/cache"
+ ;the first require() compiles the module and caches its bytecode
+ set handle=$&mlua.open(.output)
+ do assert("",output)
+ do assert(0,$&mlua.lua("package.path='"_dir_"/?.lua' return require('cachedmod').x",.output,handle))
+ do assert(1,output)
+ do assert(0,$&mlua.lua("return #io.popen('ls "_dir_"/cache/*.luac'):read('*a')>0",.output,handle))
+ do assert("true",output)
+ ;a new lua_State loads the module from the cache
+ set handle=$&mlua.open(.output)
+ do assert(0,$&mlua.lua("package.path='"_dir_"/?.lua' return require('cachedmod').x",.output,handle))
+ do assert(1,output)
+ ;changing the source invalidates the cached bytecode
+ do assert(0,$&mlua.lua("os.execute('sleep 0.01') local f=io.open('"_dir_"/cachedmod.lua','w') f:write('return {x=2}') f:close()",.output))
+ set handle=$&mlua.open(.output)
+ do assert(0,$&mlua.lua("package.path='"_dir_"/?.lua' return require('cachedmod').x",.output,handle))
+ do assert(2,output)
+ ;a cache file that others can write to is not trusted, so the module is compiled again
+ do assert(0,$&mlua.lua("os.execute('chmod 666 "_dir_"/cache/*.luac')",.output))
+ do assert(0,$&mlua.stats(.output,-1))
+ do stats(output,.stats)
+ set hits=stats("bytecode_hits")
+ set handle=$&mlua.open(.output)
+ do assert(0,$&mlua.lua("package.path='"_dir_"/?.lua' return require('cachedmod').x",.output,handle))
+ do assert(2,output)
+ do assert(0,$&mlua.stats(.output,-1))
+ kill stats do stats(output,.stats)
+ do assert(hits,stats("bytecode_hits"))
+ ;missing modules are reported as usual
+ do assertNot(0,$&mlua.lua("package.path='"_dir_"/?.lua' require('nosuchmod')",.output,handle))
+ do assert(1,output["no file '"_dir_"/nosuchmod.lua'")
+ ;MLUA_INIT is cached too: the second lua_State loads it from the cache
+ set init=$ztrnlnm("MLUA_INIT")
+ view "SETENV":"MLUA_INIT":"bytecodeinit=42"
+ set handle=$&mlua.open(.output)
+ do assert(0,$&mlua.stats(.output,-1))
+ do stats(output,.stats)
+ set hits=stats("bytecode_hits")
+ set handle=$&mlua.open(.output)
+ do assert(0,$&mlua.lua("return bytecodeinit",.output,handle))
+ do assert(42,output)
+ do assert(0,$&mlua.stats(.output,-1))
+ kill stats do stats(output,.stats)
+ do assert(hits+1,stats("bytecode_hits"))
+ view "SETENV":"MLUA_INIT":init
+ view "UNSETENV":"MLUA_BYTECODE_CACHE"
+ do assert(0,$&mlua.lua("os.execute('rm -rf "_dir_"')",.output))
+ quit
+;Test the cross-process shared store of compiled code strings
+testCodeStore()
+ new file,cmd,first,second,third
+ set file="/tmp/mlua-codestore-test-"_$job
+ ;each child process runs the same code string then writes its result and how many times it invoked the compiler
+ set cmd="MLUA_CODE_STORE="_file_" $ydb_dist/yottadb -run %XCMD 'new o,s,r do &mlua.lua(""return 41+1"",.o) set r=$&mlua.stats(.s,0) write o,"" "",s'"
+ set first=$$lua("local f=assert(io.popen(...)) local s=f:read('*a') f:close() return s",cmd)
+ set second=$$lua("local f=assert(io.popen(...)) local s=f:read('*a') f:close() return s",cmd)
+ ;the first process compiles the code and the second loads it from the store
+ do assert("42 1",$$lua("return (...):match('^(%d+) ')..' '..(...):match('compiles=(%d+)')",first),first)
+ do assert("42 0",$$lua("return (...):match('^(%d+) ')..' '..(...):match('compiles=(%d+)')",second),second)
+ ;a store that others can write to is not trusted, so the code is compiled again
+ set third=$$lua("os.execute('chmod 666 "_file_"') local f=assert(io.popen(...)) local s=f:read('*a') f:close() os.remove('"_file_"') return s",cmd)
+ do assert("42 1",$$lua("return (...):match('^(%d+) ')..' '..(...):match('compiles=(%d+)')",third),third)
+ quit
+;Test running jobs in worker threads with mlua.submit(), mlua.wait(), mlua.poll() and mlua.cancel()
+testWorkers()
+ new output,job1,job2,slow,cmd
+ set job1=$&mlua.submit("local n=0 for i=1,...+0 do n=n+i end return n",.output,1000)
+ set job2=$&mlua.submit(">string.upper",.output,"abc")
+ do assert(1,job1>0)
+ do assertNot(job1,job2)
+ do assert(0,$&mlua.wait(job2,.output))
+ do assert("ABC",output)
+ do assert(0,$&mlua.wait(job1,.output))
+ do assert(500500,output)
+ ;a job's id is released once its result is collected
+ do assert(-1,$&mlua.wait(job1,.output))
+ do assert("MLua: supplied job ("_job1_") is invalid",output)
+ do assert(-1,$&mlua.poll(job1))
+ ;errors are returned as by mlua.lua()
+ set job1=$&mlua.submit("error('oops',0)",.output)
+ do assert(-1,$&mlua.wait(job1,.output))
+ do assert("Lua: oops",output)
+ set job1=$&mlua.submit(">nosuchfunction",.output)
+ do assert(-1,$&mlua.wait(job1,.output))
+ do assert("Lua: could not find function 'nosuchfunction'",output)
+ ;workers may not call YDB
+ set job1=$&mlua.submit("require 'yottadb'",.output)
+ do assert(-1,$&mlua.wait(job1,.output))
+ do assert(1,output["YDB may not be called from a worker thread")
+ ;M can poll or wait with a timeout while the job runs
+ set slow=$&mlua.submit("local t=os.time() while os.time()-t<2 do end return 'slow'",.output)
+ do assert(0,$&mlua.poll(slow))
+ do assert(-3,$&mlua.wait(slow,.output,0))  ;MLUA_TIMEOUT from mlua.h
+ do assert(-3,$&mlua.wait(slow,.output,10))
+ do assert(0,$&mlua.wait(slow,.output))
+ do assert("slow",output)
+ ;cancelling a job releases its id
+ set slow=$&mlua.submit("local t=os.time() while os.time()-t<2 do end return 'slow'",.output)
+ do assert(0,$&mlua.cancel(slow))
+ do assert(-1,$&mlua.poll(slow))
+ do assert(-1,$&mlua.cancel(slow))
+ ;with one worker, cancelling a runaway job (LuaJIT would not interrupt it once compiled) frees the worker for the next job
+ set cmd="MLUA_WORKERS=1 $ydb_dist/yottadb -run %XCMD 'new o,j set j=$&mlua.submit(""if jit then jit.off() end while true do pcall(function() while true do end end) end"",.o) write $&mlua.wait(j,.o,10),"" "",$&mlua.cancel(j),"" "" set j=$&mlua.submit(""return 42"",.o) write $&mlua.wait(j,.o),"" "",o'"
+ do assert("-3 0 0 42",$$lua("local f=assert(io.popen(...)) local s=f:read('*a') f:close() return s",cmd))
+ ;MLUA_WORKER_MEMORY limits the memory of worker lua_States
+ set cmd="MLUA_WORKER_MEMORY=1000000 $ydb_dist/yottadb -run %XCMD 'new o,j set j=$&mlua.submit(""t={} for i=1,1e6 do t[i]=i end"",.o) write $&mlua.wait(j,.o),"" "",o'"
+ do assert("-1 Lua: not enough memory",$$lua("local f=assert(io.popen(...)) local s=f:read('*a') f:close() return s",cmd))
+ quit
+;Test applying a function to M nodes in worker threads with mlua.pmap()
+testPmap()
+ new output,in,out,i,ordered
+ for i=1:1:10 set in("x",i)=i
+ set in("x",5,"child")="ignored",in("x","a""b")="quoted"
+ kill in("x",7) set in("x",7,"child")="no value"
+ do assert(10,$&mlua.pmap("local v,sub=... if sub=='3' then return nil end return tonumber(v) and v*v or sub..'='..v","in(""x"")","out(1)",.output,2))
+ do assert("",output)
+ do assert(1,out(1,1))
+ do assert(4,out(1,2))
+ do assert(0,$data(out(1,3)))
+ do assert(100,out(1,10))
+ do assert("a""b=quoted",out(1,"a""b"))
+ do assert(0,$data(out(1,7)))
+ ;many batches over globals, with results written in node order
+ kill ^pmapin,^pmapout
+ for i=1:1:5000 set ^pmapin(i)=i
+ do assert(5000,$&mlua.pmap(">tostring","^pmapin","^pmapout",.output))
+ set ordered=1 for i=1:1:5000 set:^pmapout(i)'=i ordered=0
+ do assert(1,ordered)
+ do assert(0,$&mlua.pmap("return 1","^pmapempty","^pmapout",.output,4))
+ ;check errors
+ do assert(-1,$&mlua.pmap("local v=... if v=='4000' then error('oops',0) end return v","^pmapin","^pmapout",.output,4))
+ do assert("Lua: oops",output)
+ do assert(-1,$&mlua.pmap("require 'yottadb'","^pmapin","^pmapout",.output))
+ do assert(1,output["YDB may not be called from a worker thread")
+ do assert(-1,$&mlua.pmap("return 1","in(""x""","out",.output))
+ do assert("MLua: input variable invalid variable name syntax",output)
+ quit
+;Test streaming values from Lua generators to M with coroutines
+testCoroutines()
+ new output,co,i,list,status,handle
+ set co=$&mlua.costart("for i=1,...+0 do coroutine.yield(i*i) end return 'end'",.output,0,3)
+ do assert(1,co>0)
+ set list="" for  set status=$&mlua.conext(co,.output) quit:status<0  set list=list_output_","
+ do assert("1,4,9,",list)
+ do assert(-4,status)  ;MLUA_DONE from mlua.h
+ do assert("end",output)
+ ;the handle is released once the coroutine is done
+ do assert(-1,$&mlua.conext(co,.output))
+ do assert("MLua: supplied coroutine handle ("_co_") is invalid",output)
+ ;coroutines keep their own state and can be interleaved
+ do lua("function count(from) for i=from+0,from+9 do coroutine.yield(i) end end")
+ set co(1)=$&mlua.costart(">count",.output,0,10)
+ set co(2)=$&mlua.costart(">count",.output,0,20)
+ do assert(0,$&mlua.conext(co(1),.output)) do assert(10,output)
+ do assert(0,$&mlua.conext(co(2),.output)) do assert(20,output)
+ do assert(0,$&mlua.conext(co(1),.output)) do assert(11,output)
+ do assert(0,$&mlua.corelease(co(1)))
+ do assert(-1,$&mlua.corelease(co(1)))
+ do assert(0,$&mlua.corelease(co(2)))
+ ;errors are returned and release the handle
+ set co=$&mlua.costart("coroutine.yield(1) error('oops',0)",.output)
+ do assert(0,$&mlua.conext(co,.output)) do assert(1,output)
+ do assert(-1,$&mlua.conext(co,.output))
+ do assert("Lua: oops",output)
+ do assert(-1,$&mlua.corelease(co))
+ do assert(0,$&mlua.costart("junk",.output))
+ do assert(1,output["Lua: ")
+ ;coroutines of other lua_States have their own handles
+ set handle=$&mlua.open()
+ set co=$&mlua.costart("coroutine.yield('other')",.output,handle)
+ do assert(0,$&mlua.conext(co,.output,handle)) do assert("other",output)
+ do assert(-4,$&mlua.conext(co,.output,handle))
+ quit
+
+;Test passing a whole M variable tree to Lua as a table with mlua.tree()
+testTree()
+ new output,rec,i,handle
+ set rec="top",rec(1)="a",rec(2)="b",rec(10)="j",rec(-1.5)="neg",rec("01")="str",rec("name")="Bob"
+ set rec("addr")="home",rec("addr","city")="Gent",rec("addr","zip",1)=9000
+ do assert(0,$&mlua.tree("local t=... return t[true]..t[1]..t[2]..t[10]..t[-1.5]..t['01']..t.name",.output,,"rec"))
+ do assert("topabjnegstrBob",output)
+ do assert(0,$&mlua.tree("local t=... return math.type and math.type(next(t.addr.zip)) or type(next(t.addr.zip))",.output,,"rec"))
+ do assert(1,output="integer"!(output="number"))
+ ;subtrees, including nodes with both a value and children
+ do assert(0,$&mlua.tree("local t,a,b=... return t[true]..t.city..t.zip[1]..a..b",.output,,"rec(""addr"")","+","-"))
+ do assert("homeGent9000+-",output)
+ do assert(0,$&mlua.tree("local t=... return t[true]..tostring(next(t))",.output,,"rec(""name"")"))
+ do assert("Bobtrue",output)
+ do assert(0,$&mlua.tree("return next(...)==nil",.output,,"rec(""missing"")"))
+ do assert("true",output)
+ do assert(0,$&mlua.tree("return next(...)==nil",.output,,"undefined"))
+ do assert("true",output)
+ ;subscripts longer than the initial subscript buffers, under a root with no value, are read once each
+ new key,deep
+ set key=$translate($justify("",300)," ","x"),deep(key,1)="a",deep(key,2)="b",deep(key_"y")="c"
+ do assert(0,$&mlua.tree("local t,k=... local n=0 for _ in pairs(t[k]) do n=n+1 end return n..#t[k]..t[k][2]..t[k..'y']",.output,,"deep",key))
+ do assert("22bc",output)
+ ;globals work too, and sequences have the right length
+ kill ^treein
+ for i=1:1:1000 set ^treein("list",i)=i
+ do assert(0,$&mlua.tree("local t=... return #t.list..t.list[1000]",.output,,"^treein"))
+ do assert("10001000",output)
+ set handle=$&mlua.open(.output,4)
+ do assert(0,$&mlua.tree("return #(...)",.output,handle,"^treein(""list"")"))
+ do assert(1000,output)
+ ;check errors
+ do assertNot(0,$&mlua.tree("error('oops',0)",.output,,"rec"))
+ do assert("Lua: oops",output)
+ do assertNot(0,$&mlua.tree("return 1",.output,,"rec(""x"""))
+ do assert("MLua: variable invalid variable name syntax",output)
+ quit
+
+;Test traversing YDB from Lua with the batched iterators of module mlua
+testIterators()
+ new output,rec,i
+ set rec="top",rec(1)="a",rec(2)="b",rec(10)="j",rec("name")="Bob"
+ set rec("addr","city")="Gent",rec("addr","zip",1)=9000
+ do lua("mlua=require'mlua'")
+ ;children, including one without a value, in collation order; batches smaller than the number of children
+ do lua("function children(glvn,batch) local t={} for sub,value in mlua.children(glvn,tonumber(batch)) do t[#t+1]=sub..'='..tostring(value) end return table.concat(t,' ') end")
+ do assert(0,$&mlua.lua(">children",.output,,"rec"))
+ do assert("1=a 2=b 10=j addr=nil name=Bob",output)
+ do assert(0,$&mlua.lua(">children",.output,,"rec",2))
+ do assert("1=a 2=b 10=j addr=nil name=Bob",output)
+ do assert(0,$&mlua.lua(">children",.output,,"rec(""addr"")",1))
+ do assert("city=Gent zip=nil",output)
+ do assert(0,$&mlua.lua(">children",.output,,"rec(""missing"")"))
+ do assert("",output)
+ ;all nodes depth first, starting with the root itself
+ do lua("function nodes(glvn,batch) local t={} for value,a,b in mlua.nodes(glvn,tonumber(batch)) do t[#t+1]=table.concat({a or '',b or ''},',')..'='..value end return table.concat(t,' ') end")
+ do assert(0,$&mlua.lua(">nodes",.output,,"rec"))
+ do assert("=top 1,=a 2,=b 10,=j addr,city=Gent addr,zip=9000 name,=Bob",output)
+ do assert(0,$&mlua.lua(">nodes",.output,,"rec(""addr"")",1))
+ do assert("city,=Gent zip,1=9000",output)
+ do assert(0,$&mlua.lua("local n=0 for v in mlua.nodes('rec') do n=n+1 end return n",.output))
+ do assert(7,output)
+ ;globals, across many batches
+ kill ^iterin
+ for i=1:1:1000 set ^iterin("list",i)=i
+ do assert(0,$&mlua.lua("local n,sum=0,0 for sub,v in mlua.children('^iterin(""list"")',7) do n=n+1 sum=sum+v end return n..' '..sum",.output))
+ do assert("1000 500500",output)
+ do assert(0,$&mlua.lua("local n=0 for v,sub in mlua.nodes('^iterin') do n=n+1 end return n",.output))
+ do assert(1000,output)
+ ;check errors
+ do assertNot(0,$&mlua.lua("mlua.children('rec(')",.output))
+ do assert(1,output["MLua: variable invalid variable name syntax")
+ do assertNot(0,$&mlua.lua("mlua.nodes('rec',0)",.output))
+ do assert(1,output["batch size must be positive")
+ quit
+
+;Test buffering database updates from Lua with mlua.set() and mlua.kill() of module mlua
+testUpdates()
+ new output,upd,stats,in,i,init,handle
+ kill ^upd
+ do lua("mlua=require'mlua'")
+ ;updates are not visible until the call ends
+ do assert(0,$&mlua.lua("mlua.set('^upd(1)','a') mlua.set({'^upd',2,'x'},3.5) local n=0 for s in mlua.children('^upd') do n=n+1 end return n",.output))
+ do assert(0,output)
+ do assert("a",^upd(1))
+ do assert(3.5,^upd(2,"x"))
+ ;kills and locals
+ set upd(1)="old"
+ do assert(0,$&mlua.lua("mlua.kill('^upd(2)') mlua.set('upd(1)','new') mlua.set({'upd','a b'},true)",.output))
+ do assert(0,$data(^upd(2)))
+ do assert("new",upd(1))
+ do assert(1,upd("a b"))
+ ;a failed call makes none of its updates
+ do assertNot(0,$&mlua.lua("mlua.set('^upd(3)',1) mlua.kill('^upd') error('oops',0)",.output))
+ do assert("Lua: oops",output)
+ do assert(0,$data(^upd(3)))
+ do assert("a",^upd(1))
+ ;explicit flushes, and statistics
+ do lua("stats=mlua.flushstats()")
+ do assert(0,$&mlua.lua("mlua.set('^upd(4)',4) mlua.set('^upd(5)',5) local n=mlua.flush() local v=0 for s,value in mlua.children('^upd') do v=v+(tonumber(value) or 0) end return n..' '..v",.output))
+ do assert("2 9",output)
+ do assert(0,$&mlua.lua("local s=mlua.flushstats() return s.flushes-stats.flushes..' '..s.updates-stats.updates..' '..s.pending..' '..s.last_updates..' '..s.last_restarts",.output))
+ do assert("1 2 0 2 0",output)
+ do assert(0,$&mlua.lua("return mlua.flushstats().last_flush_ns>0",.output))
+ do assert("true",output)
+ ;updates made by mlua.map() are flushed when it ends
+ for i=1:1:10 set in(i)=i
+ do assert(10,$&mlua.map("local v,sub=... mlua.set({'^upd','map',sub},v*2)","in","out",.output))
+ do assert(20,^upd("map",10))
+ ;updates made by MLUA_INIT are flushed as the lua_State opens rather than left for some later call
+ set init=$ztrnlnm("MLUA_INIT")
+ view "SETENV":"MLUA_INIT":"require'mlua'.set('^upd(7)',7)"
+ set handle=$&mlua.open(.output)
+ view "SETENV":"MLUA_INIT":init
+ do assert(1,handle>0,output)
+ do assert(7,$get(^upd(7)))
+ do assert(0,$&mlua.lua("return require'mlua'.flushstats().pending",.output))
+ do assert(0,output)
+ do assert(0,$&mlua.close(handle))
+ ;check errors
+ do assertNot(0,$&mlua.lua("mlua.set('^upd(',1)",.output))
+ do assert(1,output["MLua: variable invalid variable name syntax")
+ do assertNot(0,$&mlua.lua("mlua.set({},1)",.output))
+ do assert(1,output["table must hold a variable name")
+ do assertNot(0,$&mlua.lua("mlua.set('^upd(6)')",.output))
+ do assertNot(0,$&mlua.lua("mlua.set('bad name',1)",.output))
+ do assert(1,output["MLua: could not flush database updates: YDB error")
+ kill ^upd
  quit